@@ -1899,6 +1899,1221 @@ type(char **sp, char *s_end, Node ***n)
 	return 0;
 }
 
+int
+byte_ranges_specifier(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "byte_ranges_specifier", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (bytes_unit(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, "=")
+		|| byte_range_set(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+bytes_unit(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "bytes_unit", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "bytes")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+byte_range_set(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p1, *p2, *p3;
+
+	createnode(*n, "byte_range_set", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p1 = *sp;
+	while (1) {
+		p2 = *sp;
+		if (string(sp, s_end, &cur, ",") || ows(sp, s_end, &cur)) {
+			*sp = p2;
+			break;
+		}
+	}
+	if (byte_range_spec(sp, s_end, &cur)
+		&& suffix_byte_range_spec(sp, s_end, &cur)) {
+		*sp = p1;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+	while (1) {
+		p2 = *sp;
+		if (ows(sp, s_end, &cur) || string(sp, s_end, &cur, ",")) {
+			*sp = p2;
+			break;
+		}
+		p3 = *sp;
+		if (ows(sp, s_end, &cur)
+			|| (byte_range_spec(sp, s_end, &cur)
+				&& suffix_byte_range_spec(sp, s_end, &cur)))
+			*sp = p3;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+byte_range_spec(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "byte_range_spec", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (first_byte_pos(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, "-")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+	p = *sp;
+	if (last_byte_pos(sp, s_end, &cur))
+		*sp = p;
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+suffix_byte_range_spec(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "suffix_byte_range_spec", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "-")
+		|| suffix_length(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+first_byte_pos(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "first_byte_pos", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (1) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 1) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+last_byte_pos(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "last_byte_pos", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (1) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 1) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+suffix_length(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "suffix_length", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (1) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 1) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+accept_encoding(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p1, *p2, *p3;
+
+	createnode(*n, "Accept_Encoding", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	while (1) {
+		p1 = *sp;
+		if (string(sp, s_end, &cur, ",") || ows(sp, s_end, &cur)) {
+			*sp = p1;
+			break;
+		}
+	}
+	p1 = *sp;
+	if (codings(sp, s_end, &cur))
+		*sp = p1;
+	else {
+		p1 = *sp;
+		if (weight(sp, s_end, &cur))
+			*sp = p1;
+	}
+	while (1) {
+		p2 = *sp;
+		if (ows(sp, s_end, &cur) || string(sp, s_end, &cur, ",")) {
+			*sp = p2;
+			break;
+		}
+		p3 = *sp;
+		if (ows(sp, s_end, &cur) || codings(sp, s_end, &cur))
+			*sp = p3;
+		else {
+			p3 = *sp;
+			if (weight(sp, s_end, &cur))
+				*sp = p3;
+		}
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+codings(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "codings", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (content_coding(sp, s_end, &cur)
+		&& string(sp, s_end, &cur, "identity")
+		&& string(sp, s_end, &cur, "*")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+content_coding(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "content_coding", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (token(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+weight(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "weight", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (ows(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, ";")
+		|| ows(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, "q=")
+		|| qvalue(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+qvalue(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p1, *p2;
+	int i;
+
+	createnode(*n, "qvalue", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p1 = *sp;
+	if (!string(sp, s_end, &cur, "0")) {
+		p2 = *sp;
+		if (string(sp, s_end, &cur, "."))
+			*sp = p2;
+		else
+			for (i = 0; i < 3; i++)
+				if (digit(sp, s_end, &cur))
+					break;
+	} else if (!string(sp, s_end, &cur, "1")) {
+		p2 = *sp;
+		if (string(sp, s_end, &cur, "."))
+			*sp = p2;
+		else
+			for (i = 0; i < 3; i++)
+				if (string(sp, s_end, &cur, "0"))
+					break;
+	} else {
+		*sp = p1;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+if_none_match(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p1, *p2, *p3;
+
+	createnode(*n, "If_None_Match", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p1 = *sp;
+	if (string(sp, s_end, &cur, "*")) {
+		while (1) {
+			p2 = *sp;
+			if (string(sp, s_end, &cur, ",") || ows(sp, s_end, &cur)) {
+				*sp = p2;
+				break;
+			}
+		}
+		if (entity_tag(sp, s_end, &cur)) {
+			*sp = p1;
+			freeTree(**n);
+			**n = NULL;
+			return 1;
+		}
+		while (1) {
+			p2 = *sp;
+			if (ows(sp, s_end, &cur) || string(sp, s_end, &cur, ",")) {
+				*sp = p2;
+				break;
+			}
+			p3 = *sp;
+			if (ows(sp, s_end, &cur) || entity_tag(sp, s_end, &cur))
+				*sp = p3;
+		}
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+if_modified_since(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "If_Modified_Since", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (http_date(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+if_range(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "If_Range", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (entity_tag(sp, s_end, &cur)
+		&& http_date(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+entity_tag(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "entity_tag", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (weak(sp, s_end, &cur))
+		*sp = p;
+	if (opaque_tag(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+weak(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "weak", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "W/")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+opaque_tag(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "opaque_tag", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (dquote(sp, s_end, &cur)) {
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+	while (1) {
+		if (etagc(sp, s_end, &cur))
+			break;
+	}
+	if (dquote(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+etagc(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+
+	createnode(*n, "etagc", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	if (string(sp, s_end, &cur, "!")
+		&& range(sp, s_end, &cur, 0x23, 0x7E)
+		&& obs_text(sp, s_end, &cur)) {
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+http_date(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "HTTP_date", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (imf_fixdate(sp, s_end, &cur)
+		&& obs_date(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+imf_fixdate(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "IMF_fixdate", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (day_name(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, ",")
+		|| space(sp, s_end, &cur)
+		|| date1(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| time_of_day(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| gmt(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+obs_date(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "obs_date", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (rfc850_date(sp, s_end, &cur)
+		&& asctime_date(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+rfc850_date(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "rfc850_date", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (day_name_l(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, ",")
+		|| space(sp, s_end, &cur)
+		|| date2(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| time_of_day(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| gmt(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+asctime_date(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "asctime_date", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (day_name(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| date3(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| time_of_day(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| year(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+date1(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "date1", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (day(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| month(sp, s_end, &cur)
+		|| space(sp, s_end, &cur)
+		|| year(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+date2(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "date2", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (day(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, "-")
+		|| month(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, "-")
+		|| digit(sp, s_end, &cur)
+		|| digit(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+date3(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p1, *p2;
+
+	createnode(*n, "date3", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p1 = *sp;
+	if (month(sp, s_end, &cur) || space(sp, s_end, &cur)) {
+		*sp = p1;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+	p2 = *sp;
+	if (digit(sp, s_end, &cur) || digit(sp, s_end, &cur)) {
+		*sp = p2;
+		if (space(sp, s_end, &cur) || digit(sp, s_end, &cur)) {
+			*sp = p1;
+			freeTree(**n);
+			**n = NULL;
+			return 1;
+		}
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+day(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "day", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (i < 2) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 2) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+day_name(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "day_name", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "Mon")
+		&& string(sp, s_end, &cur, "Tue")
+		&& string(sp, s_end, &cur, "Wed")
+		&& string(sp, s_end, &cur, "Thu")
+		&& string(sp, s_end, &cur, "Fri")
+		&& string(sp, s_end, &cur, "Sat")
+		&& string(sp, s_end, &cur, "Sun")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+day_name_l(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "day_name_l", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "Monday")
+		&& string(sp, s_end, &cur, "Tuesday")
+		&& string(sp, s_end, &cur, "Wednesday")
+		&& string(sp, s_end, &cur, "Thursday")
+		&& string(sp, s_end, &cur, "Friday")
+		&& string(sp, s_end, &cur, "Saturday")
+		&& string(sp, s_end, &cur, "Sunday")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+month(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "month", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "Jan")
+		&& string(sp, s_end, &cur, "Feb")
+		&& string(sp, s_end, &cur, "Mar")
+		&& string(sp, s_end, &cur, "Apr")
+		&& string(sp, s_end, &cur, "May")
+		&& string(sp, s_end, &cur, "Jun")
+		&& string(sp, s_end, &cur, "Jul")
+		&& string(sp, s_end, &cur, "Aug")
+		&& string(sp, s_end, &cur, "Sep")
+		&& string(sp, s_end, &cur, "Oct")
+		&& string(sp, s_end, &cur, "Nov")
+		&& string(sp, s_end, &cur, "Dec")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+year(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "year", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (i < 4) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 4) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+time_of_day(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "time_of_day", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (hour(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, ":")
+		|| minute(sp, s_end, &cur)
+		|| string(sp, s_end, &cur, ":")
+		|| second(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+hour(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "hour", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (i < 2) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 2) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+minute(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "minute", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (i < 2) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 2) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+second(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+	int i;
+
+	createnode(*n, "second", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	i = 0;
+	p = *sp;
+	while (i < 2) {
+		if (digit(sp, s_end, &cur))
+			break;
+		i++;
+	}
+	if (i < 2) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+gmt(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "GMT", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "GMT")) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
 int
 connection_header(char **sp, char *s_end, Node ***n)
 {
@@ -2084,6 +3299,156 @@ host_header(char **sp, char *s_end, Node ***n)
 	return 0;
 }
 
+int
+range_header(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "Range_header", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "Range")
+		|| string(sp, s_end, &cur, ":")
+		|| ows(sp, s_end, &cur)
+		|| byte_ranges_specifier(sp, s_end, &cur)
+		|| ows(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+if_range_header(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "If_Range_header", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "If-Range")
+		|| string(sp, s_end, &cur, ":")
+		|| ows(sp, s_end, &cur)
+		|| if_range(sp, s_end, &cur)
+		|| ows(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+if_none_match_header(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "If_None_Match_header", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "If-None-Match")
+		|| string(sp, s_end, &cur, ":")
+		|| ows(sp, s_end, &cur)
+		|| if_none_match(sp, s_end, &cur)
+		|| ows(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+if_modified_since_header(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "If_Modified_Since_header", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "If-Modified-Since")
+		|| string(sp, s_end, &cur, ":")
+		|| ows(sp, s_end, &cur)
+		|| if_modified_since(sp, s_end, &cur)
+		|| ows(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
+int
+accept_encoding_header(char **sp, char *s_end, Node ***n)
+{
+	Node **cur;
+	char *p;
+
+	createnode(*n, "Accept_Encoding_header", *sp, 0, NULL, NULL);
+	cur = &((**n)->child);
+
+	p = *sp;
+	if (string(sp, s_end, &cur, "Accept-Encoding")
+		|| string(sp, s_end, &cur, ":")
+		|| ows(sp, s_end, &cur)
+		|| accept_encoding(sp, s_end, &cur)
+		|| ows(sp, s_end, &cur)) {
+		*sp = p;
+		freeTree(**n);
+		**n = NULL;
+		return 1;
+	}
+
+	cur = &((**n)->child);
+	while (*cur) {
+		(**n)->len += (*cur)->len;
+		cur = &((*cur)->sibling);
+	}
+	*n = &((**n)->sibling);
+	return 0;
+}
+
 int
 cookie_pair(char **sp, char *s_end, Node ***n)
 {
@@ -2285,7 +3650,12 @@ header_field(char **sp, char *s_end, Node ***n)
 		&& cookie_header(sp, s_end, &cur)
 		&& transfer_encoding_header(sp, s_end, &cur)
 		&& expect_header(sp, s_end, &cur)
-		&& host_header(sp, s_end, &cur)) {
+		&& host_header(sp, s_end, &cur)
+		&& range_header(sp, s_end, &cur)
+		&& if_range_header(sp, s_end, &cur)
+		&& if_none_match_header(sp, s_end, &cur)
+		&& if_modified_since_header(sp, s_end, &cur)
+		&& accept_encoding_header(sp, s_end, &cur)) {
 		p = *sp;
 		if (field_name(sp, s_end, &cur)
 			|| string(sp, s_end, &cur, ":")
@@ -6,7 +6,8 @@
 
 static void appendTokenList(_Token **l, _Token *app);
 
-Node *root;
+/* One parse tree per thread: the server parses requests concurrently */
+__thread Node *root;
 
 void
 createnode(Node **n, char *rulename, char *val, int len, Node *child,
@@ -11,7 +11,7 @@ typedef struct node {
 	struct node *sibling;
 } Node;
 
-extern struct node *root;
+extern __thread struct node *root;
 
 void createnode(Node **n, char *rulename, char *val, int len, Node *child,
 				Node *sibling);
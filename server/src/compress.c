@@ -0,0 +1,418 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compress.h"
+
+#define SLOTS 1024 /* power of 2 */
+
+/* MIME types compressed, by prefix */
+static const char *const worth[] = {
+	"text/",
+	"application/javascript",
+	"application/json",
+	"application/xml",
+	"application/xhtml+xml",
+	"image/svg+xml",
+	NULL,
+};
+
+/* Cache: hash chains, and a list from the most to the least recently
+ * used. Threads of the pool share it.
+ */
+static Compressed *slots[SLOTS];
+static Compressed *newest = NULL;
+static Compressed *oldest = NULL;
+static size_t cached_bytes = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Output of a stream, gathered before it is passed on */
+#define STREAM_OUT 16384
+
+struct compress_stream {
+	int enc;
+	z_stream z;
+#ifdef WITH_ZSTD
+	ZSTD_CCtx *zc;
+#endif
+};
+
+int
+compressType(const char *type)
+{
+	int i;
+
+	for (i = 0; worth[i] != NULL; i++)
+		if (strncasecmp(type, worth[i], strlen(worth[i])) == 0)
+			return 1;
+	return 0;
+}
+
+int
+compressWorth(const char *type, off_t size)
+{
+	return size >= COMPRESS_MIN && size <= COMPRESS_MAX && compressType(type);
+}
+
+int
+compressCoding(const Request *req)
+{
+	static const int codings[] = {
+#ifdef WITH_ZSTD
+		ZSTD,
+#endif
+		GZIP,
+		DEFLATE,
+	};
+	int best = -1, i;
+
+	for (i = 0; i < (int)(sizeof(codings) / sizeof(codings[0])); i++)
+		if (req->accept[codings[i]] > 0
+			&& (best == -1 || req->accept[codings[i]] > req->accept[best]))
+			best = codings[i];
+	return best;
+}
+
+/* FNV-1a of the key */
+static unsigned int
+hash(const char *path, const struct timespec *mtime, int enc)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *path; path++)
+		h = (h ^ (unsigned char)*path) * 16777619U;
+	h = (h ^ (unsigned int)mtime->tv_sec) * 16777619U;
+	h = (h ^ (unsigned int)mtime->tv_nsec) * 16777619U;
+	return ((h ^ (unsigned int)enc) * 16777619U) & (SLOTS - 1);
+}
+
+static void
+entry_free(Compressed *c)
+{
+	free(c->data);
+	free(c->path);
+	free(c);
+}
+
+static void
+lru_unlink(Compressed *c)
+{
+	if (c->newer)
+		c->newer->older = c->older;
+	else
+		newest = c->older;
+	if (c->older)
+		c->older->newer = c->newer;
+	else
+		oldest = c->newer;
+}
+
+static void
+lru_push(Compressed *c)
+{
+	c->newer = NULL;
+	c->older = newest;
+	if (newest)
+		newest->newer = c;
+	else
+		oldest = c;
+	newest = c;
+}
+
+/* Drop the least recently used entries until len more bytes fit. Those
+ * still being sent are freed by their last compressRelease().
+ */
+static void
+evict(size_t len)
+{
+	Compressed *c, **pp;
+
+	while (cached_bytes + len > COMPRESS_CACHE && (c = oldest) != NULL) {
+		pp = &slots[hash(c->path, &c->mtime, c->enc)];
+		while (*pp != c)
+			pp = &(*pp)->chain;
+		*pp = c->chain;
+		lru_unlink(c);
+		cached_bytes -= c->len;
+		c->cached = 0;
+		if (c->refs == 0)
+			entry_free(c);
+	}
+}
+
+/* Read the len bytes of file fd. */
+static char *
+slurp(int fd, size_t len)
+{
+	size_t got = 0;
+	ssize_t n;
+	char *buf;
+
+	if ((buf = malloc(len)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	while (got < len) {
+		n = pread(fd, buf + got, len - got, (off_t)got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			// Truncated since: the body is sent as it is now
+			if (n == 0)
+				errno = EIO;
+			perror("pread");
+			free(buf);
+			return NULL;
+		}
+		got += (size_t)n;
+	}
+	return buf;
+}
+
+static int
+deflate_init(z_stream *z, int enc)
+{
+	// 15 bits of window; + 16: gzip wrapper, alone: the zlib one, which
+	// is what HTTP calls deflate
+	if (deflateInit2(z,
+					 COMPRESS_LEVEL,
+					 Z_DEFLATED,
+					 enc == GZIP ? 15 + 16 : 15,
+					 8,
+					 Z_DEFAULT_STRATEGY)
+		!= Z_OK) {
+		fprintf(stderr, "deflateInit2 failed\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Compress the len bytes at src in enc into c->data. Returns 0, or -1. */
+static int
+encode(Compressed *c, const char *src, size_t len, int enc)
+{
+	z_stream z;
+	size_t cap;
+	char *p;
+	int r;
+
+#ifdef WITH_ZSTD
+	if (enc == ZSTD) {
+		cap = ZSTD_compressBound(len);
+		if ((c->data = malloc(cap)) == NULL) {
+			perror("malloc");
+			return -1;
+		}
+		c->len = ZSTD_compress(c->data, cap, src, len, COMPRESS_ZSTD_LEVEL);
+		if (ZSTD_isError(c->len)) {
+			fprintf(stderr, "ZSTD_compress: %s\n", ZSTD_getErrorName(c->len));
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	memset(&z, 0, sizeof(z));
+	if (deflate_init(&z, enc) < 0)
+		return -1;
+	cap = deflateBound(&z, len);
+	if ((c->data = malloc(cap)) == NULL) {
+		perror("malloc");
+		deflateEnd(&z);
+		return -1;
+	}
+	z.next_in = (Bytef *)src;
+	z.avail_in = (uInt)len;
+	z.next_out = (Bytef *)c->data;
+	z.avail_out = (uInt)cap;
+	r = deflate(&z, Z_FINISH);
+	c->len = z.total_out;
+	deflateEnd(&z);
+	if (r != Z_STREAM_END) {
+		fprintf(stderr, "deflate failed (%d)\n", r);
+		return -1;
+	}
+	// The bound is generous: keep only what is used
+	if ((p = realloc(c->data, c->len)) != NULL)
+		c->data = p;
+	return 0;
+}
+
+Compressed *
+compressFile(const char *path, int fd, const struct stat *st, int enc)
+{
+	Compressed *c, *e;
+	unsigned int h = 0;
+	char *src;
+
+	if (path) {
+		h = hash(path, &st->st_mtim, enc);
+		pthread_mutex_lock(&lock);
+		for (c = slots[h]; c; c = c->chain)
+			if (c->enc == enc && c->mtime.tv_sec == st->st_mtim.tv_sec
+				&& c->mtime.tv_nsec == st->st_mtim.tv_nsec
+				&& strcmp(c->path, path) == 0)
+				break;
+		if (c) {
+			c->refs++;
+			lru_unlink(c);
+			lru_push(c);
+		}
+		pthread_mutex_unlock(&lock);
+		if (c)
+			return c;
+	}
+
+	// Compressed outside the lock: other threads keep serving
+	if ((c = calloc(1, sizeof(Compressed))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	c->enc = enc;
+	c->mtime = st->st_mtim;
+	c->refs = 1;
+	if ((src = slurp(fd, (size_t)st->st_size)) == NULL
+		|| encode(c, src, (size_t)st->st_size, enc) < 0) {
+		free(src);
+		entry_free(c);
+		return NULL;
+	}
+	free(src);
+	if (path == NULL || c->len > COMPRESS_CACHE
+		|| (c->path = strdup(path)) == NULL)
+		return c;
+
+	pthread_mutex_lock(&lock);
+	// Another thread may have cached the same body meanwhile
+	for (e = slots[h]; e; e = e->chain)
+		if (e->enc == enc && e->mtime.tv_sec == c->mtime.tv_sec
+			&& e->mtime.tv_nsec == c->mtime.tv_nsec
+			&& strcmp(e->path, path) == 0)
+			break;
+	if (e == NULL) {
+		evict(c->len);
+		c->chain = slots[h];
+		slots[h] = c;
+		lru_push(c);
+		cached_bytes += c->len;
+		c->cached = 1;
+	}
+	pthread_mutex_unlock(&lock);
+	return c;
+}
+
+void
+compressRelease(void *arg)
+{
+	Compressed *c = arg;
+	int last;
+
+	pthread_mutex_lock(&lock);
+	last = --c->refs == 0 && !c->cached;
+	pthread_mutex_unlock(&lock);
+	if (last)
+		entry_free(c);
+}
+
+CompressStream *
+compressStreamNew(int enc)
+{
+	CompressStream *s;
+
+	if ((s = calloc(1, sizeof(CompressStream))) == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+	s->enc = enc;
+#ifdef WITH_ZSTD
+	if (enc == ZSTD) {
+		if ((s->zc = ZSTD_createCCtx()) == NULL) {
+			fprintf(stderr, "ZSTD_createCCtx failed\n");
+			free(s);
+			return NULL;
+		}
+		ZSTD_CCtx_setParameter(
+			s->zc, ZSTD_c_compressionLevel, COMPRESS_ZSTD_LEVEL);
+		return s;
+	}
+#endif
+	if (deflate_init(&s->z, enc) < 0) {
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+int
+compressStreamWrite(CompressStream *s,
+					const char *buf,
+					size_t len,
+					int end,
+					compress_out out,
+					void *arg)
+{
+	char chunk[STREAM_OUT];
+	int r;
+
+#ifdef WITH_ZSTD
+	if (s->enc == ZSTD) {
+		ZSTD_inBuffer in = { buf, len, 0 };
+		ZSTD_outBuffer o;
+		size_t left;
+
+		do {
+			o.dst = chunk;
+			o.size = sizeof(chunk);
+			o.pos = 0;
+			left = ZSTD_compressStream2(
+				s->zc, &o, &in, end ? ZSTD_e_end : ZSTD_e_flush);
+			if (ZSTD_isError(left)) {
+				fprintf(stderr,
+						"ZSTD_compressStream2: %s\n",
+						ZSTD_getErrorName(left));
+				return -1;
+			}
+			if (o.pos > 0)
+				out(arg, chunk, o.pos);
+		} while (left != 0);
+		return 0;
+	}
+#endif
+	s->z.next_in = (Bytef *)buf;
+	s->z.avail_in = (uInt)len;
+	do {
+		s->z.next_out = (Bytef *)chunk;
+		s->z.avail_out = sizeof(chunk);
+		// A sync flush ends on a byte boundary: all of it decodes now
+		if ((r = deflate(&s->z, end ? Z_FINISH : Z_SYNC_FLUSH))
+			== Z_STREAM_ERROR) {
+			fprintf(stderr, "deflate failed (%d)\n", r);
+			return -1;
+		}
+		if (s->z.avail_out < sizeof(chunk))
+			out(arg, chunk, sizeof(chunk) - s->z.avail_out);
+	} while (s->z.avail_out == 0);
+	return 0;
+}
+
+void
+compressStreamFree(CompressStream *s)
+{
+#ifdef WITH_ZSTD
+	if (s->enc == ZSTD) {
+		ZSTD_freeCCtx(s->zc);
+		free(s);
+		return;
+	}
+#endif
+	deflateEnd(&s->z);
+	free(s);
+}
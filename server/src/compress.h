@@ -0,0 +1,111 @@
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#include "semantics.h"
+
+/* Compression of response bodies at request time: gzip and deflate with
+ * zlib, zstd when built with ZSTD=1. Bodies of unknown length, such as PHP
+ * output, are compressed as a stream. Static files are compressed once:
+ * the result stays in a per process cache of COMPRESS_CACHE bytes, keyed
+ * by path, modification time and coding, the least recently used going
+ * first when it is full. Bodies lent from the cache are counted, an
+ * evicted one is freed when its last send is done.
+ */
+
+/* Bodies smaller than this gain too little. Larger ones than COMPRESS_MAX
+ * are sent as is: a file is compressed in the handler, on the loop thread,
+ * and 256 KiB take a few milliseconds. Precompressed siblings serve the
+ * larger ones.
+ */
+#ifndef COMPRESS_MIN
+#define COMPRESS_MIN 1024
+#endif
+
+#ifndef COMPRESS_MAX
+#define COMPRESS_MAX (256 << 10)
+#endif
+
+#ifndef COMPRESS_CACHE
+#define COMPRESS_CACHE (16 << 20)
+#endif
+
+#ifndef COMPRESS_LEVEL
+#define COMPRESS_LEVEL 6 /* zlib */
+#endif
+
+#ifndef COMPRESS_ZSTD_LEVEL
+#define COMPRESS_ZSTD_LEVEL 3
+#endif
+
+typedef struct compressed {
+	char *data;
+	size_t len;
+
+	/* Cache entry, private to compress.c */
+	struct compressed *chain;
+	struct compressed *newer;
+	struct compressed *older;
+	char *path;
+	struct timespec mtime;
+	int enc;
+	int refs;
+	int cached;
+} Compressed;
+
+/* Whether bodies of this MIME type are worth compressing: text,
+ * JavaScript, JSON, XML, SVG.
+ */
+int compressType(const char *type);
+
+/* Whether a body of this type and size is: from COMPRESS_MIN to
+ * COMPRESS_MAX bytes.
+ */
+int compressWorth(const char *type, off_t size);
+
+/* The coding to compress to among those req accepts, by weight then order
+ * of encodings[], or -1 if none.
+ */
+int compressCoding(const Request *req);
+
+/* The body of file fd (st) compressed in enc. With path, it is taken from
+ * the cache, or added to it. The caller keeps fd. Returns NULL on error,
+ * the body is then sent as is; otherwise give it back with
+ * compressRelease() once sent.
+ */
+Compressed *compressFile(const char *path,
+						 int fd,
+						 const struct stat *st,
+						 int enc);
+
+/* Give back a body from compressFile(): a buffer_release for
+ * writeBufferClient().
+ */
+void compressRelease(void *arg);
+
+/* Receives compressed bytes from compressStreamWrite(). */
+typedef void (*compress_out)(void *arg, const char *buf, size_t len);
+
+typedef struct compress_stream CompressStream;
+
+/* A stream compressing to enc, NULL on error. */
+CompressStream *compressStreamNew(int enc);
+
+/* Compress the len bytes at buf and pass the result to out(arg), flushed:
+ * the client can decode everything written so far. With end, the stream
+ * is finished instead. Returns 0, or -1 on error.
+ */
+int compressStreamWrite(CompressStream *s,
+						const char *buf,
+						size_t len,
+						int end,
+						compress_out out,
+						void *arg);
+
+void compressStreamFree(CompressStream *s);
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cond.h"
+
+void
+condETag(const struct stat *st, char *buf)
+{
+	snprintf(buf,
+			 ETAG_MAX,
+			 "\"%llx-%llx-%llx\"",
+			 (unsigned long long)st->st_ino,
+			 (unsigned long long)st->st_size,
+			 (unsigned long long)st->st_mtim.tv_sec * 1000000000ULL
+				 + (unsigned long long)st->st_mtim.tv_nsec);
+}
+
+void
+condDate(time_t t, char *buf)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buf, HTTP_DATE_MAX, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+int
+condPresent(const Request *req)
+{
+	return req->if_none_match.value != NULL || req->if_modified_since != -1;
+}
+
+/* Whether the entity-tag list of If-None-Match holds etag. The comparison
+ * is weak: W/ in front of a tag is ignored.
+ */
+static int
+listed(const Node *list, const char *etag)
+{
+	const char *p = list->value, *end = list->value + list->len, *q;
+	size_t len = strlen(etag);
+
+	while ((p = memchr(p, '"', end - p)) != NULL) {
+		if ((q = memchr(p + 1, '"', end - p - 1)) == NULL)
+			break;
+		if ((size_t)(q + 1 - p) == len && memcmp(p, etag, len) == 0)
+			return 1;
+		p = q + 1;
+	}
+	return 0;
+}
+
+int
+condNotModified(const Request *req, const struct stat *st)
+{
+	char etag[ETAG_MAX];
+
+	if (req->if_none_match.value != NULL) {
+		if (req->if_none_match.len == 1 && req->if_none_match.value[0] == '*')
+			return 1;
+		condETag(st, etag);
+		return listed(&req->if_none_match, etag);
+	}
+	// A date in the future is not that of a copy: ignored
+	if (req->if_modified_since != -1 && req->if_modified_since <= time(NULL))
+		return st->st_mtime <= req->if_modified_since;
+	return 0;
+}
+
+int
+condRange(const Request *req, const struct stat *st)
+{
+	char etag[ETAG_MAX];
+
+	if (req->if_range_tag.value != NULL) {
+		// Strong comparison: a weak tag never matches
+		condETag(st, etag);
+		return (size_t)req->if_range_tag.len == strlen(etag)
+			&& memcmp(req->if_range_tag.value, etag, strlen(etag)) == 0;
+	}
+	if (req->if_range_date != -1)
+		return req->if_range_date == st->st_mtime;
+	return 1;
+}
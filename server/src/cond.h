@@ -0,0 +1,42 @@
+#ifndef _COND_H_
+#define _COND_H_
+
+#include <sys/stat.h>
+
+#include <time.h>
+
+#include "semantics.h"
+
+/* Validators of a static file and the preconditions on them (RFC 7232).
+ * The entity-tag is strong and built from the inode, size and modification
+ * time of the file, so it is known from stat() alone and changes whenever
+ * the file is written or replaced.
+ */
+
+/* Longest entity-tag written by condETag(), quotes and NUL included. */
+#define ETAG_MAX 56
+
+/* Length of an IMF-fixdate, NUL included. */
+#define HTTP_DATE_MAX 30
+
+/* Write the entity-tag of file st into buf, quotes included. */
+void condETag(const struct stat *st, char *buf);
+
+/* Write t as an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT") into buf. */
+void condDate(time_t t, char *buf);
+
+/* Whether req carries If-None-Match or If-Modified-Since. */
+int condPresent(const Request *req);
+
+/* Whether the copy req validates is still that of file st: it is then
+ * answered with a 304 and no body. If-Modified-Since only counts without
+ * If-None-Match.
+ */
+int condNotModified(const Request *req, const struct stat *st);
+
+/* Whether the ranges of req apply to file st: no If-Range, or one with the
+ * entity-tag (strong comparison) or modification date of st.
+ */
+int condRange(const Request *req, const struct stat *st);
+
+#endif
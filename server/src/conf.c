@@ -1,6 +1,23 @@
+#include <stddef.h>
+
 #include "conf.h" /* Edit this file also */
 
 char *const hosts[] = { [SITE1_FR] = "site1.fr",
 						[SITE2_FR] = "site2.fr",
 						[WWW_TOTO_COM] = "www.toto.com",
 						[WWW_FAKE_COM] = "www.fake.com" };
+
+const CacheRule cache_rules[] = {
+	/* Names carry a hash of the content: cached for a year */
+	{ ANY_HOST, PREFIX, "/assets/", 31536000, 1 },
+	{ ANY_HOST, EXTENSION, ".html", 0, 0 },
+	{ ANY_HOST, EXTENSION, ".css", 3600, 0 },
+	{ ANY_HOST, EXTENSION, ".js", 3600, 0 },
+	{ ANY_HOST, EXTENSION, ".png", 86400, 0 },
+	{ ANY_HOST, EXTENSION, ".jpg", 86400, 0 },
+	{ ANY_HOST, EXTENSION, ".gif", 86400, 0 },
+	{ ANY_HOST, EXTENSION, ".svg", 86400, 0 },
+	{ ANY_HOST, EXTENSION, ".ico", 86400, 0 },
+	{ ANY_HOST, EXTENSION, ".woff2", 604800, 0 },
+	{ ANY_HOST, 0, NULL, 0, 0 },
+};
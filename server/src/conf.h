@@ -4,7 +4,9 @@
 #define PORT 8080
 #define SITES_FOLDER "./www"
 #define DFLT_TARG "index.html"
+#define ERROR_PAGES "errors" /* <code>.html in the folder of a host */
 #define DFLT_HOST SITE1_FR
+#define DFLT_WORKERS -1 /* -1: one worker process per online CPU */
 
 /* Edit host files in conf.c */
 
@@ -17,4 +19,27 @@ enum hosts {
 };
 extern char *const hosts[];
 
+/* Caching of static files by browsers and shared caches, edited in conf.c
+ * too. A rule matches the path of the file under its docroot, by prefix
+ * ("/assets/") or extension (".css"). For a file, a prefix rule wins over
+ * an extension rule and the longest prefix wins; among equals, a rule of
+ * the host wins over an ANY_HOST one, then the first listed. Files no
+ * rule matches are sent without caching headers.
+ */
+#define ANY_HOST -1
+
+enum cache_match {
+	PREFIX,
+	EXTENSION
+};
+
+typedef struct cache_rule {
+	int host;			 /* enum hosts or ANY_HOST */
+	int match;			 /* enum cache_match */
+	const char *pattern; /* NULL: end of the rules */
+	long max_age;		 /* seconds, 0: revalidate every time */
+	int immutable;		 /* fingerprinted: never revalidated while fresh */
+} CacheRule;
+extern const CacheRule cache_rules[];
+
 #endif
@@ -0,0 +1,143 @@
+#include <sys/mman.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "coro.h"
+
+struct coro {
+	ucontext_t ctx;
+	ucontext_t caller;
+	char *stack; /* mapping: guard page then CORO_STACK bytes */
+	coro_fn fn;
+	void *arg;
+	int done;
+	struct coro *next; /* free list */
+};
+
+static __thread Coro *current = NULL;
+static __thread Coro *free_list = NULL;
+static __thread int nfree = 0;
+
+static size_t
+page_size(void)
+{
+	static size_t size = 0;
+
+	if (size == 0)
+		size = (size_t)sysconf(_SC_PAGESIZE);
+	return size;
+}
+
+static void
+trampoline(void)
+{
+	Coro *c = current;
+
+	c->fn(c->arg);
+	c->done = 1;
+	swapcontext(&c->ctx, &c->caller);
+}
+
+/* A coroutine with its stack, from the pool or newly mapped, or NULL.
+ * Not inlined into coroCreate(): its locals would live across
+ * getcontext(), which GCC assumes may return twice (-Wclobbered). It does
+ * not here, makecontext() replaces the context saved.
+ */
+static __attribute__((noinline)) Coro *
+coro_alloc(void)
+{
+	size_t page = page_size();
+	Coro *c;
+
+	if ((c = free_list) != NULL) {
+		free_list = c->next;
+		nfree--;
+		return c;
+	}
+	if ((c = (Coro *)malloc(sizeof(Coro))) == NULL) {
+		perror("malloc coro");
+		return NULL;
+	}
+	c->stack = mmap(NULL,
+					CORO_STACK + page,
+					PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+					-1,
+					0);
+	if (c->stack == MAP_FAILED) {
+		perror("mmap coro stack");
+		free(c);
+		return NULL;
+	}
+	// An overflow faults instead of corrupting the heap
+	if (mprotect(c->stack, page, PROT_NONE) < 0)
+		perror("mprotect coro guard");
+	return c;
+}
+
+static void
+coro_free(Coro *c)
+{
+	munmap(c->stack, CORO_STACK + page_size());
+	free(c);
+}
+
+Coro *
+coroCreate(coro_fn fn, void *arg)
+{
+	Coro *const c = coro_alloc();
+
+	if (c == NULL)
+		return NULL;
+	if (getcontext(&c->ctx) < 0) {
+		perror("getcontext");
+		coro_free(c);
+		return NULL;
+	}
+	c->ctx.uc_stack.ss_sp = c->stack + page_size();
+	c->ctx.uc_stack.ss_size = CORO_STACK;
+	c->ctx.uc_link = NULL;
+	makecontext(&c->ctx, trampoline, 0);
+	c->fn = fn;
+	c->arg = arg;
+	c->done = 0;
+	return c;
+}
+
+int
+coroResume(Coro *c)
+{
+	Coro *prev = current;
+
+	current = c;
+	swapcontext(&c->caller, &c->ctx);
+	current = prev;
+	if (!c->done)
+		return 0;
+
+	if (nfree < CORO_POOL) {
+		c->next = free_list;
+		free_list = c;
+		nfree++;
+	} else {
+		coro_free(c);
+	}
+	return 1;
+}
+
+void
+coroYield(void)
+{
+	Coro *c = current;
+
+	swapcontext(&c->ctx, &c->caller);
+}
+
+Coro *
+coroSelf(void)
+{
+	return current;
+}
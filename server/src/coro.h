@@ -0,0 +1,41 @@
+#ifndef _CORO_H_
+#define _CORO_H_
+
+/* Stackful coroutines on ucontext.
+ * A coroutine runs fn(arg) on its own stack until it calls coroYield(),
+ * which switches back to whoever called coroResume(). Finished coroutines
+ * keep their stack on a free list for the next coroCreate().
+ */
+typedef struct coro Coro;
+
+typedef void (*coro_fn)(void *arg);
+
+/* Usable stack of each coroutine, a guard page is mapped below it. The
+ * FastCGI client keeps a 64 KiB record on the stack, the request parser
+ * recurses over each header field: about 400 KiB for one of HEADER_MAX
+ * bytes. Pages are only committed once touched.
+ */
+#ifndef CORO_STACK
+#define CORO_STACK (1024 * 1024)
+#endif
+
+/* Finished coroutines kept for reuse, per thread. */
+#ifndef CORO_POOL
+#define CORO_POOL 64
+#endif
+
+/* Returns NULL on error. fn only starts on the first coroResume(). */
+Coro *coroCreate(coro_fn fn, void *arg);
+
+/* Run c until it yields (returns 0) or until fn returns (returns 1, c is
+ * then released and must not be used anymore).
+ */
+int coroResume(Coro *c);
+
+/* Switch back to the caller of coroResume(). */
+void coroYield(void);
+
+/* Coroutine running on this thread, NULL outside of coroutines. */
+Coro *coroSelf(void);
+
+#endif
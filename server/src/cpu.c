@@ -0,0 +1,129 @@
+#define _GNU_SOURCE /* sched_setaffinity() */
+
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "util.h"
+
+int cpu_pinning = 0;
+
+int
+cpuList(int *cpus, int max)
+{
+	cpu_set_t set;
+	int cpu, n = 0;
+
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_getaffinity");
+		return -1;
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+		if (CPU_ISSET(cpu, &set))
+			cpus[n++] = cpu;
+	}
+	return n;
+}
+
+int
+cpuNode(int cpu)
+{
+	char path[64];
+	struct dirent *e;
+	DIR *dir;
+	int node = 0;
+
+	// The CPU directory holds a nodeN link to its node
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL)
+		return 0;
+	while ((e = readdir(dir)) != NULL) {
+		if (strncmp(e->d_name, "node", 4) == 0
+			&& sscanf(e->d_name + 4, "%d", &node) == 1)
+			break;
+	}
+	closedir(dir);
+	return node;
+}
+
+int
+cpuPin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity");
+		return -1;
+	}
+	// Pages are placed on first touch: buffers and tables allocated from
+	// now on come from the node of the CPU we run on.
+	if (syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0
+		&& errno != ENOSYS)
+		perror("set_mempolicy");
+	return 0;
+}
+
+int
+cpuSteer(const int *listeners, const int *cpus, int n)
+{
+	struct sock_filter *code;
+	struct sock_fprog prog;
+	int i, ret = 0;
+
+	// One compare and one return per listener must fit in a program
+	if (n <= 0 || 2 * n + 2 > BPF_MAXINSNS)
+		return -1;
+
+	// Hint for the socket lookup, and the CPU of the accepted sockets
+	for (i = 0; i < n; i++) {
+		if (setsockopt(listeners[i],
+					   SOL_SOCKET,
+					   SO_INCOMING_CPU,
+					   &cpus[i],
+					   sizeof(cpus[i]))
+			< 0) {
+			perror("setsockopt SO_INCOMING_CPU");
+			ret = -1;
+		}
+	}
+
+	// A = receiving CPU; return the index of its listener. Indexes past
+	// the group make the kernel fall back to its hash.
+	code = emalloc((2 * n + 2) * sizeof(struct sock_filter));
+	code[0] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+										   SKF_AD_OFF + SKF_AD_CPU);
+	for (i = 0; i < n; i++) {
+		code[1 + 2 * i] = (struct sock_filter)BPF_JUMP(
+			BPF_JMP | BPF_JEQ | BPF_K, (unsigned int)cpus[i], 0, 1);
+		code[2 + 2 * i] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+	}
+	code[2 * n + 1] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, ~0U);
+
+	prog.len = (unsigned short)(2 * n + 2);
+	prog.filter = code;
+	// The program applies to the whole group, whichever socket gets it
+	if (setsockopt(listeners[0],
+				   SOL_SOCKET,
+				   SO_ATTACH_REUSEPORT_CBPF,
+				   &prog,
+				   sizeof(prog))
+		< 0) {
+		perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+		ret = -1;
+	}
+	free(code);
+	return ret;
+}
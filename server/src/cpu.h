@@ -0,0 +1,37 @@
+#ifndef _CPU_H_
+#define _CPU_H_
+
+/* CPU and NUMA placement.
+ * Workers (processes or pool threads) can be pinned one per CPU of the
+ * process affinity mask. A pinned worker allocates its memory on the NUMA
+ * node of its CPU, and in process mode its listener only gets the
+ * connections whose packets were received on that CPU.
+ */
+
+/* Set by main(): pin workers and pool threads to CPUs. */
+extern int cpu_pinning;
+
+/* Highest number of CPUs handled, as many as a cpu_set_t holds. */
+#define CPU_MAX 1024
+
+/* CPUs the process is allowed to run on, in increasing order, at most max.
+ * Returns their number, or -1 on error.
+ */
+int cpuList(int *cpus, int max);
+
+/* NUMA node of cpu, 0 when unknown. */
+int cpuNode(int cpu);
+
+/* Pin the calling thread to cpu and have its future allocations served
+ * from the local node. Returns 0, or -1 if the thread could not be pinned.
+ */
+int cpuPin(int cpu);
+
+/* Steer the connections of a SO_REUSEPORT group: a connection received on
+ * cpus[i] goes to listeners[i], connections received on other CPUs are
+ * spread by the kernel hash. listeners must be the whole group, in the
+ * order they started listening. Returns 0, or -1 on error.
+ */
+int cpuSteer(const int *listeners, const int *cpus, int n);
+
+#endif
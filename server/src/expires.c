@@ -0,0 +1,181 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "cond.h"
+#include "conf.h"
+#include "expires.h"
+
+typedef struct prefix {
+	const char *pattern; /* leading slash left out */
+	size_t len;
+	const ExpiresPolicy *policy;
+} Prefix;
+
+typedef struct extension {
+	const char *pattern; /* dot included, NULL: free slot */
+	const ExpiresPolicy *policy;
+} Extension;
+
+typedef struct host_rules {
+	Prefix *prefixes; /* longest first */
+	int nprefixes;
+	Extension exts[EXPIRES_EXTS];
+} HostRules;
+
+static ExpiresPolicy *policies = NULL; /* that of each rule, in order */
+static HostRules table[N_HOSTS];
+
+/* FNV-1a of the lowercase extension */
+static unsigned int
+hash(const char *ext)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *ext; ext++)
+		h = (h ^ (unsigned char)tolower((unsigned char)*ext)) * 16777619U;
+	return h & (EXPIRES_EXTS - 1);
+}
+
+static int
+valid(const CacheRule *r)
+{
+	if (r->host < ANY_HOST || r->host >= N_HOSTS || r->max_age < 0)
+		return 0;
+	if (r->match == PREFIX)
+		return r->pattern[0] == '/';
+	if (r->match == EXTENSION)
+		return r->pattern[0] == '.' && strchr(r->pattern, '/') == NULL;
+	return 0;
+}
+
+/* Insert after the prefixes at least as long: at equal length, those
+ * added first keep precedence.
+ */
+static void
+add_prefix(HostRules *t, const CacheRule *r, const ExpiresPolicy *p)
+{
+	size_t len = strlen(r->pattern) - 1;
+	int i;
+
+	for (i = t->nprefixes; i > 0 && t->prefixes[i - 1].len < len; i--)
+		t->prefixes[i] = t->prefixes[i - 1];
+	t->prefixes[i].pattern = r->pattern + 1;
+	t->prefixes[i].len = len;
+	t->prefixes[i].policy = p;
+	t->nprefixes++;
+}
+
+/* An extension already there keeps its policy. Returns -1 if the table is
+ * full.
+ */
+static int
+add_extension(HostRules *t, const CacheRule *r, const ExpiresPolicy *p)
+{
+	unsigned int h = hash(r->pattern), n;
+
+	for (n = 0; n < EXPIRES_EXTS; n++, h = (h + 1) & (EXPIRES_EXTS - 1)) {
+		if (t->exts[h].pattern == NULL) {
+			t->exts[h].pattern = r->pattern;
+			t->exts[h].policy = p;
+			return 0;
+		}
+		if (strcasecmp(t->exts[h].pattern, r->pattern) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+int
+expiresInit(void)
+{
+	const CacheRule *r;
+	int nrules, host, pass, i;
+
+	for (nrules = 0; cache_rules[nrules].pattern != NULL; nrules++)
+		if (!valid(&cache_rules[nrules])) {
+			fprintf(stderr,
+					"Invalid cache rule %d: %s\n",
+					nrules,
+					cache_rules[nrules].pattern);
+			errno = EINVAL;
+			return -1;
+		}
+	if ((policies = calloc(nrules + 1, sizeof(ExpiresPolicy))) == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	for (i = 0; i < nrules; i++) {
+		r = &cache_rules[i];
+		policies[i].max_age = r->max_age;
+		if (r->max_age == 0)
+			strcpy(policies[i].cache_control, "no-cache");
+		else
+			snprintf(policies[i].cache_control,
+					 CACHE_CONTROL_MAX,
+					 "public, max-age=%ld%s",
+					 r->max_age,
+					 r->immutable ? ", immutable" : "");
+	}
+
+	// Rules of the host first, then those of any host
+	for (host = 0; host < N_HOSTS; host++) {
+		if ((table[host].prefixes = calloc(nrules + 1, sizeof(Prefix)))
+			== NULL) {
+			perror("calloc");
+			return -1;
+		}
+		for (pass = 0; pass < 2; pass++)
+			for (i = 0; i < nrules; i++) {
+				r = &cache_rules[i];
+				if (r->host != (pass == 0 ? host : ANY_HOST))
+					continue;
+				if (r->match == PREFIX)
+					add_prefix(&table[host], r, &policies[i]);
+				else if (add_extension(&table[host], r, &policies[i]) < 0) {
+					fprintf(stderr,
+							"More than %d cache extensions for %s\n",
+							EXPIRES_EXTS,
+							hosts[host]);
+					errno = ENOSPC;
+					return -1;
+				}
+			}
+	}
+	return 0;
+}
+
+const ExpiresPolicy *
+expiresLookup(int host, const char *path)
+{
+	const HostRules *t;
+	const char *base, *ext;
+	unsigned int h, n;
+	int i;
+
+	if (host < 0 || host >= N_HOSTS || policies == NULL)
+		return NULL;
+	t = &table[host];
+	for (i = 0; i < t->nprefixes; i++)
+		if (strncmp(path, t->prefixes[i].pattern, t->prefixes[i].len) == 0)
+			return t->prefixes[i].policy;
+
+	base = strrchr(path, '/');
+	if ((ext = strrchr(base ? base + 1 : path, '.')) == NULL)
+		return NULL;
+	h = hash(ext);
+	for (n = 0; n < EXPIRES_EXTS && t->exts[h].pattern != NULL;
+		 n++, h = (h + 1) & (EXPIRES_EXTS - 1))
+		if (strcasecmp(t->exts[h].pattern, ext) == 0)
+			return t->exts[h].policy;
+	return NULL;
+}
+
+void
+expiresDate(const ExpiresPolicy *p, time_t now, char *buf)
+{
+	condDate(now + p->max_age, buf);
+}
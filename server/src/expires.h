@@ -0,0 +1,38 @@
+#ifndef _EXPIRES_H_
+#define _EXPIRES_H_
+
+#include <time.h>
+
+/* Caching headers of static files (Cache-Control, Expires) from the rules
+ * of conf.c. expiresInit() compiles them once into a table per host: its
+ * prefixes, longest first, and a hash table of its extensions, those of
+ * ANY_HOST rules merged in. A request then costs a few prefix compares
+ * and one hash probe.
+ */
+
+#ifndef EXPIRES_EXTS
+#define EXPIRES_EXTS 64 /* extensions per host, power of 2 */
+#endif
+
+/* Longest Cache-Control value, NUL included. */
+#define CACHE_CONTROL_MAX 48
+
+typedef struct expires_policy {
+	char cache_control[CACHE_CONTROL_MAX];
+	long max_age;
+} ExpiresPolicy;
+
+/* Compile cache_rules[]. Returns 0, or -1 if a rule is invalid. */
+int expiresInit(void);
+
+/* The policy of path (relative to the docroot of host, without leading
+ * slash), NULL if no rule matches.
+ */
+const ExpiresPolicy *expiresLookup(int host, const char *path);
+
+/* Write the Expires date of p for a response sent at now into buf
+ * (HTTP_DATE_MAX bytes).
+ */
+void expiresDate(const ExpiresPolicy *p, time_t now, char *buf);
+
+#endif
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE /* nftw() */
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "fdcache.h"
+
+#define SLOTS 256 /* power of 2 */
+
+/* Changes that drop entries, reported by the directory holding them */
+#define EVENTS                                                         \
+	(IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF \
+	 | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
+
+static FdFile *slots[SLOTS];
+
+/* Open files and failed opens are evicted apart, least recently used
+ * first: requests for random missing paths only push out other missing
+ * paths.
+ */
+static struct lru {
+	FdFile *newest;
+	FdFile *oldest;
+	int n;
+	int max;
+} files = { NULL, NULL, 0, FDCACHE_FILES },
+  missing = { NULL, NULL, 0, FDCACHE_MISSING };
+static unsigned long hits = 0;
+static unsigned long misses = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* inotify of this process: -1 until its first lookup, -2 if unavailable.
+ * The master never looks up: each worker sets up its own after fork().
+ */
+static int ino = -1;
+static char **watched = NULL; /* directory of each watch descriptor */
+static int nwatched = 0;
+static long polled = 0; /* when the events were last read */
+static unsigned long changes = 0; /* batches of events read */
+
+/* Milliseconds, from the vDSO: no system call */
+static long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* FNV-1a of the path */
+static unsigned int
+hash(const char *path)
+{
+	unsigned int h = 2166136261U;
+
+	for (; *path; path++)
+		h = (h ^ (unsigned char)*path) * 16777619U;
+	return h & (SLOTS - 1);
+}
+
+static void
+entry_free(FdFile *f)
+{
+	if (f->fd >= 0)
+		close(f->fd);
+	free(f->path);
+	free(f);
+}
+
+static struct lru *
+lru_of(const FdFile *f)
+{
+	return f->fd < 0 ? &missing : &files;
+}
+
+static void
+lru_unlink(FdFile *f)
+{
+	struct lru *l = lru_of(f);
+
+	if (f->newer)
+		f->newer->older = f->older;
+	else
+		l->newest = f->older;
+	if (f->older)
+		f->older->newer = f->newer;
+	else
+		l->oldest = f->newer;
+}
+
+static void
+lru_push(FdFile *f)
+{
+	struct lru *l = lru_of(f);
+
+	f->newer = NULL;
+	f->older = l->newest;
+	if (l->newest)
+		l->newest->newer = f;
+	else
+		l->oldest = f;
+	l->newest = f;
+}
+
+/* Take f out of the cache. One still sent is closed by its last
+ * fdcacheRelease().
+ */
+static void
+drop(FdFile *f)
+{
+	FdFile **pp = &slots[hash(f->path)];
+
+	while (*pp != f)
+		pp = &(*pp)->chain;
+	*pp = f->chain;
+	lru_unlink(f);
+	lru_of(f)->n--;
+	f->cached = 0;
+	if (f->refs == 0)
+		entry_free(f);
+}
+
+/* Drop the entries of path and, for a directory, of all below it. */
+static void
+invalidate(const char *path)
+{
+	size_t len = strlen(path);
+	FdFile *f, *next;
+	int i;
+
+	for (i = 0; i < SLOTS; i++)
+		for (f = slots[i]; f; f = next) {
+			next = f->chain;
+			if (strncmp(f->path, path, len) == 0
+				&& (f->path[len] == '\0' || f->path[len] == '/'))
+				drop(f);
+		}
+}
+
+static void
+add_watch(const char *dir)
+{
+	char **p;
+	int wd;
+
+	if ((wd = inotify_add_watch(ino, dir, EVENTS | IN_ONLYDIR)) < 0) {
+		// Left to FDCACHE_TTL
+		perror("inotify_add_watch");
+		return;
+	}
+	if (wd >= nwatched) {
+		if ((p = realloc(watched, (wd + 1) * sizeof(char *))) == NULL) {
+			perror("realloc");
+			return;
+		}
+		memset(p + nwatched, 0, (wd + 1 - nwatched) * sizeof(char *));
+		watched = p;
+		nwatched = wd + 1;
+	}
+	// Same directory seen again, moved for instance: its path is updated
+	free(watched[wd]);
+	watched[wd] = strdup(dir);
+}
+
+static int
+watch_dir(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)ftw;
+	if (flag == FTW_D)
+		add_watch(path);
+	return 0;
+}
+
+static void
+watch_tree(const char *dir)
+{
+	if (nftw(dir, watch_dir, 16, FTW_PHYS) < 0)
+		perror(dir);
+}
+
+static void
+start(void)
+{
+	if ((ino = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+		perror("inotify_init1");
+		ino = -2;
+		return;
+	}
+	watch_tree(SITES_FOLDER);
+}
+
+/* Read the changes inotify reported since the last time, at most every
+ * FDCACHE_POLL milliseconds.
+ */
+static void
+poll_events(long now)
+{
+	char buf[4096]
+		__attribute__((aligned(__alignof__(struct inotify_event))));
+	char path[PATH_MAX];
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	if (ino < 0 || now - polled < FDCACHE_POLL)
+		return;
+	polled = now;
+	while ((n = read(ino, buf, sizeof(buf))) > 0) {
+		changes++;
+		for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				// Changes lost: nothing can be trusted
+				while (files.oldest)
+					drop(files.oldest);
+				while (missing.oldest)
+					drop(missing.oldest);
+				continue;
+			}
+			if (ev->wd < 0 || ev->wd >= nwatched || watched[ev->wd] == NULL)
+				continue;
+			if (ev->mask & IN_IGNORED) {
+				free(watched[ev->wd]);
+				watched[ev->wd] = NULL;
+				continue;
+			}
+			if (ev->len == 0) {
+				invalidate(watched[ev->wd]);
+				continue;
+			}
+			snprintf(path, sizeof(path), "%s/%s", watched[ev->wd], ev->name);
+			invalidate(path);
+			if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+				watch_tree(path);
+		}
+	}
+}
+
+// open() then fstat() on the descriptor, so the stat matches what is served.
+static int
+open_stat(const char *path, struct stat *st)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, st) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+FdFile *
+fdcacheOpen(const char *path)
+{
+	unsigned int h = hash(path);
+	long now = now_ms();
+	unsigned long seen;
+	struct lru *l;
+	FdFile *f, *e;
+	int err;
+
+	pthread_mutex_lock(&lock);
+	if (ino == -1)
+		start();
+	poll_events(now);
+	for (f = slots[h]; f; f = f->chain)
+		if (strcmp(f->path, path) == 0)
+			break;
+	if (f && now - f->born >= FDCACHE_TTL * 1000L) {
+		drop(f);
+		f = NULL;
+	}
+	if (f) {
+		hits++;
+		f->refs++;
+		lru_unlink(f);
+		lru_push(f);
+	} else
+		misses++;
+	seen = changes;
+	pthread_mutex_unlock(&lock);
+
+	// Opened outside the lock: other threads keep serving
+	if (f == NULL) {
+		if ((f = calloc(1, sizeof(FdFile))) == NULL
+			|| (f->path = strdup(path)) == NULL) {
+			perror("calloc");
+			free(f);
+			errno = ENOMEM;
+			return NULL;
+		}
+		f->born = now;
+		f->refs = 1;
+		if ((f->fd = open_stat(path, &f->st)) < 0) {
+			f->err = errno;
+			// Only answers that stay true until the tree changes
+			if (f->err != ENOENT && f->err != ENOTDIR && f->err != EACCES) {
+				err = f->err;
+				entry_free(f);
+				errno = err;
+				return NULL;
+			}
+		}
+		pthread_mutex_lock(&lock);
+		// Another thread may have cached the same file meanwhile, or read
+		// events that would have dropped this entry: it is then only used
+		// for this lookup
+		for (e = slots[h]; e; e = e->chain)
+			if (strcmp(e->path, path) == 0)
+				break;
+		if (e == NULL && seen == changes) {
+			l = lru_of(f);
+			if (l->n >= l->max)
+				drop(l->oldest);
+			f->chain = slots[h];
+			slots[h] = f;
+			lru_push(f);
+			l->n++;
+			f->cached = 1;
+		}
+		pthread_mutex_unlock(&lock);
+	}
+
+	if (f->fd < 0) {
+		err = f->err;
+		fdcacheRelease(f);
+		errno = err;
+		return NULL;
+	}
+	return f;
+}
+
+void
+fdcacheRef(FdFile *f)
+{
+	pthread_mutex_lock(&lock);
+	f->refs++;
+	pthread_mutex_unlock(&lock);
+}
+
+void
+fdcacheRelease(void *arg)
+{
+	FdFile *f = arg;
+	int last;
+
+	pthread_mutex_lock(&lock);
+	last = --f->refs == 0 && !f->cached;
+	pthread_mutex_unlock(&lock);
+	if (last)
+		entry_free(f);
+}
+
+void
+fdcacheCounters(unsigned long *h, unsigned long *m)
+{
+	pthread_mutex_lock(&lock);
+	*h = hits;
+	*m = misses;
+	pthread_mutex_unlock(&lock);
+}
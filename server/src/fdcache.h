@@ -0,0 +1,73 @@
+#ifndef _FDCACHE_H_
+#define _FDCACHE_H_
+
+#include <sys/stat.h>
+
+#include <time.h>
+
+/* Open files of the docroots, kept with their stat() so that a hot file
+ * costs no system call: a per process cache of FDCACHE_FILES entries keyed
+ * by path, the least recently used closed first when it is full. Failed
+ * opens (no such file, permission denied) are cached as well, which spares
+ * the lookups of precompressed siblings that do not exist. They hold no
+ * descriptor and have their own FDCACHE_MISSING entries, so that requests
+ * for missing paths do not evict open files.
+ *
+ * inotify watches every directory under SITES_FOLDER: a change to a file
+ * or directory drops the entries at and below its path. Events are read by
+ * the lookups themselves, at most once per tick of the coarse clock (a few
+ * milliseconds) under load; entries older than FDCACHE_TTL seconds are
+ * dropped all the same, for changes inotify misses (watch limit reached,
+ * paths spelt differently).
+ *
+ * Entries are shared by the threads of the pool and counted: one evicted
+ * or invalidated while sent is closed by its last fdcacheRelease().
+ */
+#ifndef FDCACHE_FILES
+#define FDCACHE_FILES 128
+#endif
+
+#ifndef FDCACHE_MISSING
+#define FDCACHE_MISSING 256
+#endif
+
+#ifndef FDCACHE_TTL
+#define FDCACHE_TTL 5 /* seconds */
+#endif
+
+#ifndef FDCACHE_POLL
+#define FDCACHE_POLL 1 /* milliseconds */
+#endif
+
+typedef struct fd_file {
+	int fd; /* read with pread() or sendfile() only: the offset is shared */
+	struct stat st;
+
+	/* Cache entry, private to fdcache.c */
+	struct fd_file *chain;
+	struct fd_file *newer;
+	struct fd_file *older;
+	char *path;
+	int err; /* failed open: its errno, fd -1 */
+	long born;
+	int refs;
+	int cached;
+} FdFile;
+
+/* Open path with its stat(), from the cache or added to it. Returns NULL
+ * with errno set if it cannot be opened; otherwise give the file back with
+ * fdcacheRelease() once done with it.
+ */
+FdFile *fdcacheOpen(const char *path);
+
+/* Take one more reference on f, for a range of it queued to a client. */
+void fdcacheRef(FdFile *f);
+
+/* Give back a reference on f: a buffer_release for writeSharedFileClient().
+ */
+void fdcacheRelease(void *arg);
+
+/* Lookups answered from the cache, and the others, by this process. */
+void fdcacheCounters(unsigned long *hits, unsigned long *misses);
+
+#endif
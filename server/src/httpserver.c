@@ -1,6 +1,5 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -8,6 +7,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,196 +17,687 @@
 #include "api.h"
 #include "httpparser.h" // this will declare internal type used by the parser
 
+#include "compress.h"
+#include "cond.h"
 #include "conf.h"
 #include "content_type.h"
+#include "cpu.h"
+#include "expires.h"
+#include "fdcache.h"
 #include "phptohtml.h"
+#include "range.h"
+#include "ratelimit.h"
+#include "reply.h"
 #include "request.h"
 #include "semantics.h"
+#include "upgrade.h"
+#include "uring.h"
 #include "util.h"
+#include "worker.h"
 
+#define ACCEPT_RANGES "Accept-Ranges: "
+#define CACHE_CONTROL "Cache-Control: "
 #define CONNECTION "Connection: "
+#define CONTENT_ENCODING "Content-Encoding: "
 #define CONTENT_LENGTH "Content-Length: "
+#define CONTENT_RANGE "Content-Range: "
 #define CONTENT_TYPE "Content-Type: "
+#define MULTIPART "multipart/byteranges; boundary="
+#define ETAG "ETag: "
+#define EXPIRES "Expires: "
+#define TRANSFER_ENCODING "Transfer-Encoding: "
+#define VARY "Vary: "
+#define LAST_MODIFIED "Last-Modified: "
 #define DEFAULT_TYPE "application/octet-stream"
+#define PHP_TYPE "text/html"
 #define CRLF "\r\n"
 
+/* Status line and headers of a response, sent with a single write. */
+#define HEAD_MAX 2048
+
+typedef struct head {
+	char buf[HEAD_MAX];
+	size_t len;
+} Head;
+
+static void handle(message *request);
+static void head_add(Head *h, const char *fmt, ...);
+static void head_send(Head *h, int client);
+static void head_validators(Head *h, const struct stat *st, int weak);
+static void head_caching(Head *h, const ExpiresPolicy *policy);
+static void send_error(Head *h,
+					   int client,
+					   int host,
+					   int code,
+					   int connection,
+					   int head_only);
+static void send_parts(Head *h,
+					   int client,
+					   FdFile *file,
+					   const char *type,
+					   const Span *spans,
+					   int n);
+static void send_php(Head *h, const Request *req, int client, char *script);
 static char *buildtarget(Request *req);
+static int sidecar(const Request *req,
+				   const char *target,
+				   char **path,
+				   FdFile **file);
+static int is_php(const char *path);
 
 char *const status[] = { [200] = "HTTP/1.1 200 OK",
+						 [206] = "HTTP/1.1 206 Partial Content",
+						 [304] = "HTTP/1.1 304 Not Modified",
 						 [400] = "HTTP/1.1 400 Bad Request",
 						 [403] = "HTTP/1.1 403 Forbidden",
 						 [404] = "HTTP/1.1 404 Not Found",
+						 [416] = "HTTP/1.1 416 Range Not Satisfiable",
 						 [501] = "HTTP/1.1 501 Not Implemented",
+						 [503] = "HTTP/1.1 503 Service Unavailable",
+						 [502] = "HTTP/1.1 502 Bad Gateway",
 						 [505] = "HTTP/1.1 505 HTTP Version Not Supported" };
 
 int
 main(int argc, char *argv[])
 {
-	while (1) {
-		message *request = NULL;
-		_Token *root = NULL;
-		Request *req = NULL;
-		int fi = -1;
-		struct stat st;
-		char *body = NULL;
-		char length_buf[32];
-		char *target = NULL;
-		char *type = NULL;
-
-		// On attend la reception d'une requete HTTP, request pointera vers une ressource allouée.
-		printf("Waiting for request...\n");
-		if ((request = getRequest(PORT)) == NULL)
-			error("getRequest");
-
-		// Affichage de debug
-		printf("#########################################\nReceived request "
-			   "from client %d\n",
-			   request->clientId);
-		printf("Client [%d] [%s:%d]\n",
-			   request->clientId,
-			   inet_ntoa(request->clientAddress->sin_addr),
-			   htons(request->clientAddress->sin_port));
-		printf("Request is as follows:\n%.*s\n", request->len, request->buf);
-
-		if (!parseur(request->buf, request->len)) {
-			printf("Invalid request syntax\n");
-			writeDirectClient(
-				request->clientId, status[400], strlen(status[400]));
-			writeDirectClient(request->clientId, CRLF, strlen(CRLF));
-			writeDirectClient(request->clientId, CRLF, strlen(CRLF));
+	int opt, fd;
+	int workers = DFLT_WORKERS;
+	int threads = -1;
+	int ip_conns = RATE_CONNS;
+	int ip_rps = RATE_RPS;
+
+	upgradeInit(argc, argv);
+	while ((opt = getopt(argc, argv, "w:t:ub:ac:r:q:i:I:z")) != -1) {
+		switch (opt) {
+		case 'w':
+			workers = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'b':
+			requestSetBacklog(atoi(optarg));
+			break;
+		case 'a':
+			cpu_pinning = 1;
+			break;
+		case 'c':
+			requestSetLimits(atoi(optarg), 0);
+			break;
+		case 'r':
+			requestSetLimits(0, atoi(optarg));
+			break;
+		case 'q':
+			phpSetLimit(atoi(optarg));
+			break;
+		case 'i':
+			ip_conns = atoi(optarg);
+			break;
+		case 'I':
+			ip_rps = atoi(optarg);
+			break;
+		case 'z':
+			requestSetZerocopy(1);
+			break;
+		case 'u':
+#ifdef WITH_URING
+			uring_enabled = 1;
+#else
+			fprintf(stderr, "Built without io_uring, ignoring -u\n");
+#endif
+			break;
+		default:
+			fprintf(stderr,
+					"Usage: %s [-w n | -t n] [-u] [-a] [-b n] [-c n] [-r n]"
+					" [-q n] [-i n] [-I n] [-z]\n"
+					"  -w 0  single process, no master\n"
+					"  -w n  n worker processes (default: one per CPU)\n"
+					"  -t n  n threads in one process (0: one per CPU)\n"
+					"  -u    io_uring event loop (processes only)\n"
+					"  -a    pin workers or threads to CPUs\n"
+					"  -b n  listen backlog (default: net.core.somaxconn)\n"
+					"  -c n  connections per process before answering 503\n"
+					"  -r n  requests in flight per process before 503\n"
+					"  -q n  requests waiting on php-fpm before 503\n"
+					"  -i n  connections per client address (0: no limit)\n"
+					"  -I n  requests per second per client address\n"
+					"  -z    send large in-memory bodies with MSG_ZEROCOPY\n",
+					argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// Before forking the workers: they share the per-address counters
+	rateSetLimits(ip_conns, ip_rps);
+	if (rateInit() < 0)
+		fprintf(stderr, "Per-address limits disabled\n");
+	if (expiresInit() < 0)
+		error("expiresInit");
+	if (replyInit(status) < 0)
+		error("replyInit");
+
+	// La boucle d'evenements appelle handle() pour chaque requete complete.
+	printf("Waiting for requests on port %d...\n", PORT);
+	if (threads >= 0) {
+		if ((fd = requestListen(PORT, 0)) < 0)
+			error("requestListen");
+		if (requestLoopThreads(fd, threads, handle) < 0)
+			error("requestLoopThreads");
+		exit(EXIT_SUCCESS);
+	}
+	if (workers != 0) {
+		if (runWorkers(workers, PORT, handle) < 0)
+			error("runWorkers");
+		exit(EXIT_SUCCESS);
+	}
+	if ((fd = requestListen(PORT, 0)) < 0)
+		error("requestListen");
+	if (requestLoop(fd, handle) < 0)
+		error("requestLoop");
+	exit(EXIT_SUCCESS);
+}
+
+static void
+handle(message *request)
+{
+	_Token *root = NULL;
+	Request *req = NULL;
+	FdFile *file = NULL;
+	struct stat st;
+	Head head = { .len = 0 };
+	Span spans[RANGE_MAX];
+	int nspans = -1;
+	int dynamic = 0;
+	char *target = NULL;
+	char *encoded = NULL;
+	int enc = -1;
+	int vary = 0;
+	Compressed *z = NULL;
+	const ExpiresPolicy *policy = NULL;
+	char *type = NULL;
+	char addr[INET_ADDRSTRLEN];
+
+	// Affichage de debug
+	printf("#########################################\nReceived request "
+		   "from client %d\n",
+		   request->clientId);
+	printf("Client [%d] [%s:%d]\n",
+		   request->clientId,
+		   inet_ntop(AF_INET,
+					 &request->clientAddress->sin_addr,
+					 addr,
+					 sizeof(addr)),
+		   htons(request->clientAddress->sin_port));
+	printf("Request is as follows:\n%.*s\n", request->len, request->buf);
+
+	if (!parseur(request->buf, request->len)) {
+		printf("Invalid request syntax\n");
+		send_error(&head, request->clientId, -1, 400, CLOSE, 0);
+		endWriteDirectClient(request->clientId);
+		printf("Closing connection\n");
+		requestShutdownSocket(request->clientId);
+		// Free the parse tree for this request
+		root = getRootTree();
+		purgeTree(root);
+	} else {
+		printf("Valid request syntax\n");
+		root = getRootTree();
+		req = semantics(root);
+		/* php-fpm saturated: refuse before touching the disk */
+		if (req->status == 200 && is_php(req->target) && !phpAdmit())
+			req->status = 503;
+
+		if (req->status == 503) {
+			printf("PHP queue full, shedding load\n");
+			requestShed(request->clientId);
+		} else if (req->status != 200) {
+			/* Semantic error (400 / 501 / 505 / etc.) */
+			printf("Invalid request semantics (status %d)\n", req->status);
+			send_error(&head,
+					   request->clientId,
+					   req->host,
+					   req->status,
+					   CLOSE,
+					   req->method == HEAD);
 			endWriteDirectClient(request->clientId);
 			printf("Closing connection\n");
 			requestShutdownSocket(request->clientId);
-			// Free the parse tree for this request
-			root = getRootTree();
-			purgeTree(root);
 		} else {
-			printf("Valid request syntax\n");
-			root = getRootTree();
-			req = semantics(root);
-
-			if (req->status != 200) {
-				/* Semantic error (400 / 501 / 505 / etc.) */
-				printf("Invalid request semantics (status %d)\n", req->status);
-				printf("%.*s\n",
-					   (int)strlen(status[req->status]),
-					   status[req->status]);
-				writeDirectClient(request->clientId,
-								  status[req->status],
-								  strlen(status[req->status]));
-				writeDirectClient(request->clientId, CRLF, strlen(CRLF));
-				writeDirectClient(request->clientId, CRLF, strlen(CRLF));
-				endWriteDirectClient(request->clientId);
-				printf("Closing connection\n");
-				requestShutdownSocket(request->clientId);
-			} else {
-				/* Semantics OK: now we can build a path and touch the filesystem */
-				printf("Valid request semantics\n");
-				target = buildtarget(req);
-				printf("Fetching requested resource: %s\n", target);
-				/* Open file and save size */
-				if ((fi = open(target, O_RDONLY)) == -1) {
-					if (errno == EACCES) {
-						req->status = 403;
-					} else if (errno == ENOENT) {
-						req->status = 404;
-					} else {
-						error("open target");
-					}
+			/* Semantics OK: now we can build a path and touch the filesystem */
+			printf("Valid request semantics\n");
+			/* Request cap reached or server draining: last response */
+			if (!request->keepAlive)
+				req->connection = CLOSE;
+			dynamic = is_php(req->target);
+			/* PHP output is streamed: HTTP/1.0 has no chunks, the body
+			 * ends with the connection */
+			if (dynamic && req->version == HTTP1_0)
+				req->connection = CLOSE;
+			target = buildtarget(req);
+			/* Precompressed copy the client accepts: sent as is, with
+			 * the type of the original */
+			if (!dynamic) {
+				enc = sidecar(req, target, &encoded, &file);
+				policy = expiresLookup(req->host, req->target);
+			}
+			printf("Fetching requested resource: %s\n",
+				   encoded ? encoded : target);
+			/* Open file and save size, from the file cache: a hot file
+			 * costs no system call */
+			if (file == NULL && (file = fdcacheOpen(target)) == NULL) {
+				if (errno == EACCES) {
+					req->status = 403;
+				} else if (errno == ENOENT || errno == ENOTDIR) {
+					req->status = 404;
 				} else {
-					if (fstat(fi, &st) == -1) /* To obtain file size */
-						error("fstat");
-					if ((body = mmap(
-							 NULL, st.st_size, PROT_READ, MAP_PRIVATE, fi, 0))
-						== MAP_FAILED)
-						error("mmap");
+					error("open target");
 				}
-				printf("%.*s\n",
-					   (int)strlen(status[req->status]),
-					   status[req->status]);
-				writeDirectClient(request->clientId,
-								  status[req->status],
-								  strlen(status[req->status]));
-				writeDirectClient(request->clientId, CRLF, strlen(CRLF));
-				/* Error from filesystem (403/404) */
-				if (req->status != 200) {
-					writeDirectClient(request->clientId, CRLF, strlen(CRLF));
-					endWriteDirectClient(request->clientId);
+			} else if (!S_ISREG(file->st.st_mode)) {
+				/* A directory or special file is not served */
+				req->status = 403;
+			} else {
+				st = file->st;
+				/* Text without precompressed copy is compressed here:
+				 * every answer on it varies with Accept-Encoding, and
+				 * the entity-tag of the compressed one is weak */
+				if (!dynamic && enc < 0) {
+					type = file_content_type(target);
+					if ((vary = compressWorth(type, st.st_size)))
+						enc = compressCoding(req);
+				}
+				/* Copy of the client still valid: no body */
+				if (!dynamic && condPresent(req) && condNotModified(req, &st))
+					req->status = 304;
+				/* Range: only part of the file, or none of it */
+				else if (!dynamic) {
+					if ((nspans = rangeSpans(req, &st, spans)) == 0)
+						req->status = 416;
+					else if (nspans > 0)
+						req->status = 206;
+				}
+			}
+			head_add(&head, "%s" CRLF, status[req->status]);
+			head_add(&head,
+					 CONNECTION "%s" CRLF,
+					 connections[req->connection]);
+			if (req->status == 304) {
+				/* No body, and no Content-Length: that of the copy */
+				head_validators(&head, &st, vary && enc >= 0);
+				head_caching(&head, policy);
+				if (enc >= 0 || vary)
+					head_add(&head, VARY "Accept-Encoding" CRLF);
+				head_send(&head, request->clientId);
+				endWriteDirectClient(request->clientId);
+				if (req->connection == CLOSE)
 					requestShutdownSocket(request->clientId);
-					/* Valid 200 OK */
-				} else {
-					printf("%s%.*s\n",
-						   CONNECTION,
-						   (int)strlen(connections[req->connection]),
-						   connections[req->connection]);
-					writeDirectClient(
-						request->clientId, CONNECTION, strlen(CONNECTION));
-					writeDirectClient(request->clientId,
-									  connections[req->connection],
-									  strlen(connections[req->connection]));
-					writeDirectClient(request->clientId, CRLF, strlen(CRLF));
-					switch (req->method) {
-					case GET:
-						writeDirectClient(request->clientId,
-										  CONTENT_LENGTH,
-										  strlen(CONTENT_LENGTH));
-						snprintf(length_buf,
-								 sizeof(length_buf),
-								 "%lld",
-								 (long long)st.st_size);
-						printf("%s%.*s\n",
-							   CONTENT_LENGTH,
-							   (int)strlen(length_buf),
-							   length_buf);
-						writeDirectClient(
-							request->clientId, length_buf, strlen(length_buf));
-						writeDirectClient(
-							request->clientId, CRLF, strlen(CRLF));
-
-						writeDirectClient(request->clientId,
-										  CONTENT_TYPE,
-										  strlen(CONTENT_TYPE));
-						type = file_content_type(target);
-						printf(
-							"%s%.*s\n", CONTENT_TYPE, (int)strlen(type), type);
-						writeDirectClient(
-							request->clientId, type, strlen(type));
-						writeDirectClient(
-							request->clientId, CRLF, strlen(CRLF));
-
-						writeDirectClient(
-							request->clientId, CRLF, strlen(CRLF));
-						writeDirectClient(request->clientId, body, st.st_size);
+				/* Unsatisfiable range: the size of the file, empty body
+				 * keeps the connection reusable */
+			} else if (req->status == 416) {
+				head_add(&head,
+						 CONTENT_RANGE "bytes */%lld" CRLF,
+						 (long long)st.st_size);
+				head_add(&head, CONTENT_LENGTH "0" CRLF);
+				head_send(&head, request->clientId);
+				endWriteDirectClient(request->clientId);
+				if (req->connection == CLOSE)
+					requestShutdownSocket(request->clientId);
+				/* Error from filesystem (403/404): prebuilt */
+			} else if (req->status != 200 && req->status != 206) {
+				send_error(&head,
+						   request->clientId,
+						   req->host,
+						   req->status,
+						   req->connection,
+						   req->method == HEAD);
+				endWriteDirectClient(request->clientId);
+				if (req->connection == CLOSE)
+					requestShutdownSocket(request->clientId);
+			} else if (dynamic) {
+				/* The script exists: run it, its output is sent as
+				 * php-fpm produces it */
+				send_php(&head, req, request->clientId, target);
+				if (req->connection == CLOSE)
+					requestShutdownSocket(request->clientId);
+				/* Valid 200 OK */
+			} else {
+				if (type == NULL)
+					type = file_content_type(target);
+				/* A range is of the file as is, only a whole body is
+				 * compressed, once */
+				if (vary && nspans > 0)
+					enc = -1;
+				else if (vary && enc >= 0 && req->method == GET
+						 && (z = compressFile(target, file->fd, &st, enc))
+							== NULL)
+					enc = -1;
+				head_add(&head, ACCEPT_RANGES "bytes" CRLF);
+				head_validators(&head, &st, vary && enc >= 0);
+				head_caching(&head, policy);
+				if (enc >= 0)
+					head_add(&head, CONTENT_ENCODING "%s" CRLF, encodings[enc]);
+				if (enc >= 0 || vary)
+					head_add(&head, VARY "Accept-Encoding" CRLF);
+				switch (req->method) {
+				case GET:
+					if (z) {
+						head_add(&head,
+								 CONTENT_LENGTH "%zu" CRLF
+									 CONTENT_TYPE "%s" CRLF,
+								 z->len,
+								 type);
+						head_send(&head, request->clientId);
+						/* Lent, not copied: MSG_ZEROCOPY applies (-z) */
+						writeBufferClient(request->clientId,
+										  z->data,
+										  z->len,
+										  compressRelease,
+										  z);
 						endWriteDirectClient(request->clientId);
 						break;
-					case HEAD:
-						writeDirectClient(
-							request->clientId, CRLF, strlen(CRLF));
+					}
+					if (nspans > 1) {
+						send_parts(&head,
+								   request->clientId,
+								   file,
+								   type,
+								   spans,
+								   nspans);
 						endWriteDirectClient(request->clientId);
 						break;
 					}
-					if (req->connection == CLOSE) {
-						printf("Closing connection.\n");
-						requestShutdownSocket(request->clientId);
+					if (nspans < 0) {
+						spans[0].off = 0;
+						spans[0].len = st.st_size;
 					}
-					if (body && st.st_size > 0)
-						munmap(body, st.st_size);
-					if (fi != -1)
-						close(fi);
+					head_add(&head,
+							 CONTENT_LENGTH "%lld" CRLF CONTENT_TYPE "%s" CRLF,
+							 (long long)spans[0].len,
+							 type);
+					if (nspans == 1)
+						head_add(&head,
+								 CONTENT_RANGE "bytes %lld-%lld/%lld" CRLF,
+								 (long long)spans[0].off,
+								 (long long)(spans[0].off + spans[0].len - 1),
+								 (long long)st.st_size);
+					head_send(&head, request->clientId);
+					/* Sent from the file as the client reads it, right
+					 * behind the header */
+					fdcacheRef(file);
+					writeSharedFileClient(request->clientId,
+										  file->fd,
+										  spans[0].off,
+										  spans[0].len,
+										  fdcacheRelease,
+										  file);
+					endWriteDirectClient(request->clientId);
+					break;
+				case HEAD:
+					head_send(&head, request->clientId);
+					endWriteDirectClient(request->clientId);
+					break;
+				}
+				if (req->connection == CLOSE) {
+					printf("Closing connection.\n");
+					requestShutdownSocket(request->clientId);
 				}
 			}
-			purgeTree(root);
 		}
-		// on ne se sert plus de request a partir de maintenant, on peut donc liberer...
-		freeRequest(request);
-		if (req)
-			free(req);
-		if (type)
-			free(type);
-		if (target)
-			free(target);
-	}
-	error("HTTP server ended unexpectedly");
+		purgeTree(root);
+	}
+	// on ne se sert plus de request a partir de maintenant, on peut donc liberer...
+	freeRequest(request);
+	if (req) {
+		free(req->target);
+		free(req);
+	}
+	if (type)
+		free(type);
+	if (target)
+		free(target);
+	if (encoded)
+		free(encoded);
+	if (file)
+		fdcacheRelease(file);
+}
+
+/* Append a header line to h. One that does not fit is left out. */
+static void
+head_add(Head *h, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(h->buf + h->len, sizeof(h->buf) - h->len, fmt, ap);
+	va_end(ap);
+	if (n > 0 && (size_t)n < sizeof(h->buf) - h->len)
+		h->len += (size_t)n;
+}
+
+/* Append the ETag and Last-Modified of file st to h. A body compressed
+ * on the fly is not the same bytes as the file: its entity-tag is weak.
+ */
+static void
+head_validators(Head *h, const struct stat *st, int weak)
+{
+	char etag[ETAG_MAX], date[HTTP_DATE_MAX];
+
+	condETag(st, etag);
+	condDate(st->st_mtime, date);
+	head_add(h,
+			 ETAG "%s%s" CRLF LAST_MODIFIED "%s" CRLF,
+			 weak ? "W/" : "",
+			 etag,
+			 date);
+}
+
+/* Answer code to client: the prebuilt response for host, or a bodiless
+ * one built in h for codes without.
+ */
+static void
+send_error(Head *h,
+		   int client,
+		   int host,
+		   int code,
+		   int connection,
+		   int head_only)
+{
+	if (replySend(client, host, code, connection, head_only) == 0) {
+		printf("%s (prebuilt)\n", status[code]);
+		return;
+	}
+	h->len = 0;
+	head_add(h,
+			 "%s" CRLF CONNECTION "%s" CRLF CONTENT_LENGTH "0" CRLF,
+			 status[code],
+			 connections[connection]);
+	head_send(h, client);
+}
+
+/* Append the Cache-Control and Expires of policy to h, if any. */
+static void
+head_caching(Head *h, const ExpiresPolicy *policy)
+{
+	char date[HTTP_DATE_MAX];
+
+	if (policy == NULL)
+		return;
+	expiresDate(policy, time(NULL), date);
+	head_add(h,
+			 CACHE_CONTROL "%s" CRLF EXPIRES "%s" CRLF,
+			 policy->cache_control,
+			 date);
+}
+
+/* Answer the n spans of file as multipart/byteranges: each part header is
+ * queued, then its range of the file, holding a reference of its own.
+ */
+static void
+send_parts(Head *h,
+		   int client,
+		   FdFile *file,
+		   const char *type,
+		   const Span *spans,
+		   int n)
+{
+	char boundary[RANGE_BOUNDARY];
+	char part[512];
+	const struct stat *st = &file->st;
+	size_t len;
+	int i;
+
+	rangeBoundary(boundary);
+	head_add(h,
+			 CONTENT_LENGTH "%lld" CRLF CONTENT_TYPE MULTIPART "%s" CRLF,
+			 (long long)rangeMultipartLength(
+				 spans, n, st->st_size, type, boundary),
+			 boundary);
+	head_send(h, client);
+	for (i = 0; i <= n; i++) {
+		len = rangePartHead(part,
+							sizeof(part),
+							i < n ? &spans[i] : NULL,
+							st->st_size,
+							type,
+							boundary);
+		if (len >= sizeof(part)) {
+			// Cannot match the announced length any more
+			requestShutdownSocket(client);
+			return;
+		}
+		writeDirectClient(client, part, (unsigned int)len);
+		if (i == n)
+			break;
+		fdcacheRef(file);
+		writeSharedFileClient(client,
+							  file->fd,
+							  spans[i].off,
+							  spans[i].len,
+							  fdcacheRelease,
+							  file);
+	}
+}
+
+/* End the header and queue it in one piece. */
+static void
+head_send(Head *h, int client)
+{
+	head_add(h, CRLF);
+	printf("%.*s", (int)h->len, h->buf);
+	writeDirectClient(client, h->buf, (unsigned int)h->len);
+}
+
+/* A PHP response while php-fpm produces it */
+typedef struct php_reply {
+	Head *head;
+	const Request *req;
+	int client;
+	int chunked; /* HTTP/1.1: chunked body, else up to the close */
+	int started; /* header sent */
+	CompressStream *z;
+} PhpReply;
+
+/* Send body bytes as they come, compressed or not. Large pieces are lent
+ * as a copy, which then leaves with MSG_ZEROCOPY (-z): the kernel does not
+ * copy them a second time.
+ */
+static void
+php_send(void *arg, const char *buf, size_t len)
+{
+	PhpReply *r = (PhpReply *)arg;
+	size_t min = requestZerocopyMin();
+	char *copy;
+
+	if (len == 0)
+		return;
+	if (min > 0 && len >= min) {
+		copy = emalloc(len);
+		memcpy(copy, buf, len);
+		if (r->chunked) {
+			writeChunkBufferClient(r->client, copy, len, free, copy);
+		} else {
+			writeBufferClient(r->client, copy, len, free, copy);
+			requestFlush(r->client);
+		}
+	} else if (r->chunked) {
+		writeChunkClient(r->client, buf, len);
+	} else {
+		writeDirectClient(r->client, (char *)buf, (unsigned int)len);
+		requestFlush(r->client);
+	}
+}
+
+/* The CGI header of the script is read: send the response header. */
+static void
+php_head(void *arg, const char *type)
+{
+	PhpReply *r = (PhpReply *)arg;
+	int enc;
+
+	if (type == NULL)
+		type = PHP_TYPE;
+	if (compressType(type)) {
+		head_add(r->head, VARY "Accept-Encoding" CRLF);
+		if ((enc = compressCoding(r->req)) >= 0 && r->req->method == GET
+			&& (r->z = compressStreamNew(enc)) == NULL)
+			enc = -1;
+		if (enc >= 0)
+			head_add(r->head, CONTENT_ENCODING "%s" CRLF, encodings[enc]);
+	}
+	head_add(r->head, CONTENT_TYPE "%s" CRLF, type);
+	if (r->chunked)
+		head_add(r->head, TRANSFER_ENCODING "chunked" CRLF);
+	head_send(r->head, r->client);
+	requestFlush(r->client);
+	r->started = 1;
+}
+
+static void
+php_body(void *arg, const char *buf, size_t len)
+{
+	PhpReply *r = (PhpReply *)arg;
+
+	if (r->req->method == HEAD)
+		return;
+	if (r->z)
+		compressStreamWrite(r->z, buf, len, 0, php_send, r);
+	else
+		php_send(r, buf, len);
+}
+
+/* Answer with the output of script, h holding the status line: header
+ * once php-fpm sent that of the script, then the body, chunk after chunk
+ * (HTTP/1.1) or up to the close (HTTP/1.0). A script that fails before
+ * its header gets a 502, one that fails later a body cut short by the
+ * close, without its last chunk.
+ */
+static void
+send_php(Head *h, const Request *req, int client, char *script)
+{
+	PhpReply r = { h, req, client, req->version == HTTP1_1, 0, NULL };
+	PhpOutput out = { php_head, php_body, &r };
+	int ok;
+
+	ok = phptohtml(script, &out) == 0;
+	if (!r.started) {
+		h->len = 0;
+		head_add(h, "%s" CRLF, status[502]);
+		head_add(h, CONNECTION "%s" CRLF, connections[req->connection]);
+		head_add(h, CONTENT_LENGTH "0" CRLF);
+		head_send(h, client);
+		endWriteDirectClient(client);
+		return;
+	}
+	if (r.z) {
+		if (ok)
+			ok = compressStreamWrite(r.z, NULL, 0, 1, php_send, &r) == 0;
+		compressStreamFree(r.z);
+	}
+	if (!ok)
+		requestShutdownSocket(client);
+	else if (r.chunked && req->method == GET)
+		writeChunkClient(client, NULL, 0);
+	endWriteDirectClient(client);
 }
 
 static char *
@@ -241,13 +732,56 @@ buildtarget(Request *req)
 		target[i + j + k] = req->target[k];
 	}
 	target[i + j + k] = '\0';
+	return target;
+}
 
-	if (!strcmp(target + strlen(target) - strlen(".php"), ".php")) {
-		printf("php file detected: %s\n", target);
-		phptohtml(target);
-		free(target);
-		target = strdup(PHP_RESULT_FILE);
+/* The precompressed sibling of target (target.br, .zst or .gz) whose
+ * coding the client accepts: the one it weighs most, the first in
+ * encodings[] among equals. Returns its coding, its path in *path (to
+ * free) and the file opened in *file, or -1 if there is none.
+ */
+static int
+sidecar(const Request *req, const char *target, char **path, FdFile **file)
+{
+	static const char *const suffix[N_ENCODINGS] = {
+		[BR] = ".br",
+		[ZSTD] = ".zst",
+		[GZIP] = ".gz",
+		/* deflate: none */
+	};
+	int tried = 0, best, i;
+
+	while (1) {
+		best = -1;
+		for (i = 0; i < N_ENCODINGS; i++)
+			if (req->accept[i] > 0 && !(tried & 1 << i)
+				&& (best == -1 || req->accept[i] > req->accept[best]))
+				best = i;
+		if (best == -1)
+			return -1;
+		tried |= 1 << best;
+		if (suffix[best] == NULL)
+			continue;
+		*path = emalloc(strlen(target) + strlen(suffix[best]) + 1);
+		strcpy(*path, target);
+		strcat(*path, suffix[best]);
+		// Cached, missing ones included: no system call once seen
+		if ((*file = fdcacheOpen(*path)) != NULL) {
+			if (S_ISREG((*file)->st.st_mode))
+				return best;
+			fdcacheRelease(*file);
+			*file = NULL;
+		}
+		free(*path);
+		*path = NULL;
 	}
-	free(req->target);
-	return target;
+}
+
+static int
+is_php(const char *path)
+{
+	size_t len = strlen(path);
+
+	return len >= strlen(".php")
+		&& !strcmp(path + len - strlen(".php"), ".php");
 }
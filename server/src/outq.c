@@ -0,0 +1,486 @@
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "outq.h"
+
+/* Cleared once sendfile() is refused: file ranges are then read. */
+static int use_sendfile = 1;
+
+/* Lent buffers from this size on leave with MSG_ZEROCOPY, 0: never. */
+static size_t zerocopy_min = 0;
+
+static void
+append(OutQueue *q, OutSeg *s)
+{
+	if (q->tail)
+		q->tail->next = s;
+	else
+		q->head = s;
+	q->tail = s;
+}
+
+static void
+seg_free(OutSeg *s)
+{
+	if (s->fd >= 0 && s->release == NULL)
+		close(s->fd);
+	if (s->release)
+		s->release(s->arg);
+	free(s);
+}
+
+static OutSeg *
+seg_new(size_t cap)
+{
+	OutSeg *s;
+
+	if ((s = (OutSeg *)malloc(sizeof(OutSeg) + cap)) == NULL) {
+		perror("malloc");
+		return NULL;
+	}
+	s->next = NULL;
+	s->fd = -1;
+	s->off = 0;
+	s->data = cap > 0 ? (char *)(s + 1) : NULL;
+	s->len = 0;
+	s->room = cap;
+	s->release = NULL;
+	s->arg = NULL;
+	s->zc = 0;
+	s->zc_id = 0;
+	return s;
+}
+
+void
+outqSetZerocopy(size_t min)
+{
+	zerocopy_min = min;
+}
+
+void
+outqInit(OutQueue *q)
+{
+	q->head = NULL;
+	q->tail = NULL;
+	q->bytes = 0;
+	q->zc_head = NULL;
+	q->zc_tail = NULL;
+	q->zc_next = 0;
+	q->zc_on = 0;
+}
+
+int
+outqEmpty(const OutQueue *q)
+{
+	return q->bytes == 0 && q->zc_head == NULL;
+}
+
+int
+outqWrite(OutQueue *q, const char *buf, size_t len)
+{
+	OutSeg *s = q->tail;
+	size_t n, cap;
+
+	while (len > 0) {
+		// Headers and small bodies share a buffer, a large body gets its
+		// own once the current one is full.
+		if (s == NULL || s->fd >= 0 || s->room == 0) {
+			cap = len > OUTQ_CHUNK ? len : OUTQ_CHUNK;
+			if ((s = seg_new(cap)) == NULL)
+				return -1;
+			append(q, s);
+		}
+		n = len < s->room ? len : s->room;
+		memcpy(s->data + s->len, buf, n);
+		s->len += n;
+		s->room -= n;
+		q->bytes += n;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int
+outqFile(OutQueue *q, int fd, off_t off, size_t len)
+{
+	OutSeg *s;
+
+	if (len == 0) {
+		close(fd);
+		return 0;
+	}
+	if ((s = seg_new(0)) == NULL) {
+		close(fd);
+		return -1;
+	}
+	s->fd = fd;
+	s->off = off;
+	s->len = len;
+	append(q, s);
+	q->bytes += len;
+	return 0;
+}
+
+int
+outqFileRef(OutQueue *q,
+			int fd,
+			off_t off,
+			size_t len,
+			outq_release release,
+			void *arg)
+{
+	OutSeg *s;
+
+	if (len == 0) {
+		release(arg);
+		return 0;
+	}
+	if ((s = seg_new(0)) == NULL) {
+		release(arg);
+		return -1;
+	}
+	s->fd = fd;
+	s->off = off;
+	s->len = len;
+	s->release = release;
+	s->arg = arg;
+	append(q, s);
+	q->bytes += len;
+	return 0;
+}
+
+int
+outqRef(OutQueue *q,
+		const char *data,
+		size_t len,
+		outq_release release,
+		void *arg)
+{
+	OutSeg *s;
+
+	if (len == 0 || (s = seg_new(0)) == NULL) {
+		if (release)
+			release(arg);
+		return len == 0 ? 0 : -1;
+	}
+	// No room: the next write gets a buffer of its own
+	s->data = (char *)data;
+	s->len = len;
+	s->release = release;
+	s->arg = arg;
+	append(q, s);
+	q->bytes += len;
+	return 0;
+}
+
+/* Whether s leaves alone: a file range for sendfile(), lent bytes for
+ * MSG_ZEROCOPY.
+ */
+static int
+alone(const OutSeg *s)
+{
+	if (s->fd >= 0)
+		return use_sendfile && s->len >= OUTQ_SENDFILE;
+	return zerocopy_min > 0 && s->release && s->len >= zerocopy_min;
+}
+
+/* Turn SO_ZEROCOPY on for sock, or MSG_ZEROCOPY off for good. */
+static int
+zerocopy_on(OutQueue *q, int sock)
+{
+	int one = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		perror("setsockopt SO_ZEROCOPY");
+		zerocopy_min = 0;
+		return -1;
+	}
+	// Pinned pages do not join the headers in one packet: Nagle would
+	// hold the short end of the body until the client's delayed ACK.
+	if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+		perror("setsockopt TCP_NODELAY");
+	q->zc_on = 1;
+	return 0;
+}
+
+/* Read the next bytes of file range s, at most size. */
+static ssize_t
+read_range(OutSeg *s, char *bounce, size_t size)
+{
+	ssize_t n;
+
+	do
+		n = pread(s->fd, bounce, s->len < size ? s->len : size, s->off);
+	while (n < 0 && errno == EINTR);
+	if (n == 0) {
+		// Truncated since: the length announced cannot be honoured
+		errno = EIO;
+		return -1;
+	}
+	return n;
+}
+
+/* Point iov at the segments at the head of the queue, up to max. File
+ * ranges are read into bounce one after the other, the list ends where it
+ * is full. With split, a segment that leaves alone ends it and sets *more.
+ */
+static int
+gather(OutQueue *q,
+	   struct iovec *iov,
+	   int max,
+	   char *bounce,
+	   size_t size,
+	   int split,
+	   int *more)
+{
+	size_t used = 0;
+	OutSeg *s;
+	ssize_t n;
+	int cnt;
+
+	*more = 0;
+	for (cnt = 0, s = q->head; s && cnt < max; s = s->next) {
+		if (split && alone(s)) {
+			*more = 1;
+			break;
+		}
+		if (s->fd < 0) {
+			iov[cnt].iov_base = s->data;
+			iov[cnt++].iov_len = s->len;
+			continue;
+		}
+		if (used == size)
+			break;
+		if ((n = read_range(s, bounce + used, size - used)) < 0)
+			return -1;
+		iov[cnt].iov_base = bounce + used;
+		iov[cnt++].iov_len = (size_t)n;
+		used += (size_t)n;
+		// Its end is for the next call
+		if ((size_t)n < s->len)
+			break;
+	}
+	return cnt;
+}
+
+int
+outqIov(OutQueue *q, struct iovec *iov, int max, char *bounce, size_t size)
+{
+	int more;
+
+	return gather(q, iov, max, bounce, size, 0, &more);
+}
+
+ssize_t
+outqSend(OutQueue *q, int sock)
+{
+	static __thread char bounce[OUTQ_READ];
+	struct iovec iov[OUTQ_IOV];
+	struct msghdr msg;
+	size_t total = 0, want;
+	OutSeg *s;
+	off_t off;
+	ssize_t n;
+	int cnt, i, more;
+
+	while ((s = q->head) != NULL) {
+		if (alone(s) && s->fd < 0) {
+			if (!q->zc_on && zerocopy_on(q, sock) < 0)
+				continue;
+			// The kernel pins the pages and reads them as it transmits
+			want = s->len;
+			iov[0].iov_base = s->data;
+			iov[0].iov_len = want;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 1;
+			n = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | MSG_ZEROCOPY);
+			if (n < 0 && errno == ENOBUFS) {
+				// Over the locked memory limit: copied this time
+				n = sendmsg(sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+			} else if (n > 0) {
+				s->zc = 1;
+				s->zc_id = q->zc_next++;
+			}
+		} else if (alone(s)) {
+			// From the page cache to the socket: no copy, no mapping
+			want = s->len;
+			off = s->off;
+			n = sendfile(sock, s->fd, &off, want);
+			if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+				// Not for this file system: read ranges instead
+				use_sendfile = 0;
+				continue;
+			}
+			if (n == 0) {
+				// Truncated since: the length announced cannot be
+				// honoured
+				errno = EIO;
+				return -1;
+			}
+		} else {
+			// Consecutive segments leave in one system call: headers and
+			// a small file are a single packet. Headers followed by a
+			// large range wait for its first bytes (MSG_MORE).
+			if ((cnt = gather(
+					 q, iov, OUTQ_IOV, bounce, sizeof(bounce), 1, &more))
+				< 0)
+				return -1;
+			for (want = 0, i = 0; i < cnt; i++)
+				want += iov[i].iov_len;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov;
+			msg.msg_iovlen = cnt;
+			n = sendmsg(sock,
+						&msg,
+						MSG_NOSIGNAL | MSG_DONTWAIT | (more ? MSG_MORE : 0));
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0)
+			return -1;
+		outqConsume(q, (size_t)n);
+		total += (size_t)n;
+		// Short send: the socket buffer is full
+		if ((size_t)n < want)
+			break;
+	}
+	return (ssize_t)total;
+}
+
+void
+outqConsume(OutQueue *q, size_t n)
+{
+	OutSeg *s;
+	size_t k;
+
+	while (n > 0 && (s = q->head) != NULL) {
+		k = n < s->len ? n : s->len;
+		if (s->fd >= 0)
+			s->off += (off_t)k;
+		else
+			s->data += k;
+		s->len -= k;
+		q->bytes -= k;
+		n -= k;
+		if (s->len > 0)
+			break;
+		if ((q->head = s->next) == NULL)
+			q->tail = NULL;
+		if (!s->zc) {
+			seg_free(s);
+			continue;
+		}
+		// The kernel may still read it
+		s->next = NULL;
+		if (q->zc_tail)
+			q->zc_tail->next = s;
+		else
+			q->zc_head = s;
+		q->zc_tail = s;
+	}
+}
+
+void
+outqReap(OutQueue *q, int sock)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)
+							+ sizeof(struct sockaddr_in6))];
+	struct sock_extended_err *ee;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	OutSeg *s;
+
+	while (q->zc_head) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+				&& !(cm->cmsg_level == SOL_IPV6
+					 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// Sends ee_info to ee_data are done, and all those before
+			while ((s = q->zc_head) != NULL
+				   && (int32_t)(s->zc_id - ee->ee_data) <= 0) {
+				q->zc_head = s->next;
+				seg_free(s);
+			}
+		}
+	}
+	if (q->zc_head == NULL)
+		q->zc_tail = NULL;
+}
+
+int
+outqPinned(const OutQueue *q)
+{
+	const OutSeg *s;
+
+	if (q->zc_head)
+		return 1;
+	// Partly sent: the kernel reads what left already
+	for (s = q->head; s; s = s->next)
+		if (s->zc)
+			return 1;
+	return 0;
+}
+
+void
+outqDrop(OutQueue *q)
+{
+	OutSeg *s;
+
+	while ((s = q->head) != NULL) {
+		q->head = s->next;
+		if (!s->zc) {
+			seg_free(s);
+			continue;
+		}
+		// Partly sent with MSG_ZEROCOPY: released by outqReap() too
+		s->next = NULL;
+		if (q->zc_tail)
+			q->zc_tail->next = s;
+		else
+			q->zc_head = s;
+		q->zc_tail = s;
+	}
+	// Still numbered like the sends on the socket
+	q->tail = NULL;
+	q->bytes = 0;
+}
+
+void
+outqClear(OutQueue *q)
+{
+	OutSeg *s;
+
+	outqDrop(q);
+	while ((s = q->zc_head) != NULL) {
+		q->zc_head = s->next;
+		seg_free(s);
+	}
+	q->zc_tail = NULL;
+}
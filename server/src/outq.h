@@ -0,0 +1,162 @@
+#ifndef _OUTQ_H_
+#define _OUTQ_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Output queue of a connection: the responses its handlers wrote, in
+ * order, until the socket has room for them. A segment holds either bytes
+ * copied from the handler, small writes packed into OUTQ_CHUNK buffers, a
+ * buffer the handler lent by reference, or a range of an open file that is
+ * only read, or handed to sendfile(), when its turn comes.
+ */
+#ifndef OUTQ_CHUNK
+#define OUTQ_CHUNK 16384
+#endif
+
+/* Bytes of a file range read per send. */
+#ifndef OUTQ_READ
+#define OUTQ_READ 65536
+#endif
+
+/* File ranges from this size on are sent with sendfile(), straight from
+ * the page cache. Smaller ones are read and leave with the headers in one
+ * packet.
+ */
+#ifndef OUTQ_SENDFILE
+#define OUTQ_SENDFILE 65536
+#endif
+
+/* Lent buffers from this size on are sent with MSG_ZEROCOPY once
+ * outqSetZerocopy() enabled it: the kernel then reads their pages instead
+ * of copying them, and tells when it is done on the error queue of the
+ * socket. Below about 10 KiB, pinning the pages costs more than the copy;
+ * FastCGI records are up to 64 KiB - 1.
+ */
+#ifndef OUTQ_ZEROCOPY
+#define OUTQ_ZEROCOPY 16384
+#endif
+
+/* Buffers sent together by one sendmsg(). */
+#ifndef OUTQ_IOV
+#define OUTQ_IOV 64
+#endif
+
+/* Gives a lent buffer back to its owner. */
+typedef void (*outq_release)(void *arg);
+
+typedef struct out_seg {
+	struct out_seg *next;
+	int fd;		 /* file range: descriptor, -1: bytes */
+	off_t off;	 /* file range: offset of the next byte to send */
+	char *data;	 /* bytes: next byte to send */
+	size_t len;	 /* left to send */
+	size_t room; /* bytes: free space after data + len */
+
+	/* Lent bytes or file: release(arg) gives them back; a file without
+	 * release is the queue's. zc is set once bytes were sent with
+	 * MSG_ZEROCOPY, zc_id numbers the last of these sends.
+	 */
+	outq_release release;
+	void *arg;
+	int zc;
+	uint32_t zc_id;
+} OutSeg;
+
+typedef struct out_queue {
+	OutSeg *head;
+	OutSeg *tail;
+	size_t bytes; /* left to send, file ranges included */
+
+	/* Sent with MSG_ZEROCOPY, in order: released once the kernel is done */
+	OutSeg *zc_head;
+	OutSeg *zc_tail;
+	uint32_t zc_next; /* number of the next MSG_ZEROCOPY send */
+	int zc_on;		  /* SO_ZEROCOPY set on the socket */
+} OutQueue;
+
+/* Send lent buffers of at least min bytes with MSG_ZEROCOPY, 0: never
+ * (default). Only outqSend() does; it turns it off for good if the kernel
+ * refuses SO_ZEROCOPY.
+ */
+void outqSetZerocopy(size_t min);
+
+void outqInit(OutQueue *q);
+
+/* Nothing left to send and no buffer still read by the kernel. */
+int outqEmpty(const OutQueue *q);
+
+/* Queue a copy of buf. Returns 0, or -1 if out of memory. */
+int outqWrite(OutQueue *q, const char *buf, size_t len);
+
+/* Queue len bytes of file fd from off. The queue takes fd over and closes
+ * it once sent, or on error. Returns 0, or -1 if out of memory.
+ */
+int outqFile(OutQueue *q, int fd, off_t off, size_t len);
+
+/* Queue len bytes of file fd from off, fd staying its owner's: it is
+ * neither closed nor its offset moved, and release(arg) is called once the
+ * range is sent or dropped, or on error before returning -1.
+ */
+int outqFileRef(OutQueue *q,
+				int fd,
+				off_t off,
+				size_t len,
+				outq_release release,
+				void *arg);
+
+/* Queue len bytes at data without copying them. They must not change until
+ * release(arg) is called: once sent, or once the kernel is done with their
+ * pages if they left with MSG_ZEROCOPY, or when the queue is cleared. On
+ * error, release is called before returning -1.
+ */
+int outqRef(OutQueue *q,
+			const char *data,
+			size_t len,
+			outq_release release,
+			void *arg);
+
+/* Send what the non-blocking TCP socket sock takes, without waiting.
+ * Returns the number of bytes sent, q->bytes tells what is left, or -1 on
+ * error (errno set).
+ */
+ssize_t outqSend(OutQueue *q, int sock);
+
+/* Point iov at up to max segments from the head of the queue, to send
+ * them together. File ranges are read into bounce, up to size bytes in
+ * all. Valid until outqConsume().
+ * Returns the number of iovecs filled, 0 if the queue is empty, -1 on
+ * error.
+ */
+int outqIov(
+	OutQueue *q, struct iovec *iov, int max, char *bounce, size_t size);
+
+/* Drop the first n bytes, sent. */
+void outqConsume(OutQueue *q, size_t n);
+
+/* Read the MSG_ZEROCOPY completions waiting on the error queue of sock and
+ * release the buffers the kernel is done with.
+ */
+void outqReap(OutQueue *q, int sock);
+
+/* Some buffer of q, sent in whole or in part with MSG_ZEROCOPY, may still
+ * be read by the kernel.
+ */
+int outqPinned(const OutQueue *q);
+
+/* Drop what is left to send and close the files. Buffers sent in whole or
+ * in part with MSG_ZEROCOPY stay until outqReap() sees the kernel done with
+ * them: outqEmpty() then tells.
+ */
+void outqDrop(OutQueue *q);
+
+/* Drop everything queued, close the files and release the buffers, even
+ * those the kernel may still read: only once the socket is closed, after
+ * SO_LINGER 0 dropped its send queue.
+ */
+void outqClear(OutQueue *q);
+
+#endif
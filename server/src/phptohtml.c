@@ -3,9 +3,11 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
@@ -13,44 +15,115 @@
 
 #include "fastcgi.h"
 #include "phptohtml.h"
+#include "request.h"
 #include "util.h"
 
+static int runPhp(char *phpfile, PhpOutput *out);
 static int createSocket(int port);
 static size_t readSocket(int fd, char *buf, size_t len);
 static void readData(int fd, FCGI_Header *h, size_t *len);
-static void writeSocket(int fd, FCGI_Header *h, unsigned int len);
+static int writeSocket(int fd, FCGI_Header *h, unsigned int len);
 static void writeLen(int len, char **p);
 static int addNameValuePair(FCGI_Header *h, char *name, char *value);
 static void sendBeginRequest(int fd, unsigned short requestId,
 							 unsigned short role, unsigned char flags);
 
+/* Past the empty line ending the CGI header, whose lines end with CRLF or
+ * LF alone, or NULL if it is not complete yet.
+ */
 static const char *
 find_body_start(const char *buf, size_t n)
 {
-	if (n < 4)
-		return NULL;
-	for (size_t i = 0; i + 3 < n; ++i) {
-		if (buf[i] == '\r'
-			&& buf[i + 1] == '\n'
-			&& buf[i + 2] == '\r'
-			&& buf[i + 3] == '\n')
-			return buf + i + 4;
+	for (size_t i = 0; i + 1 < n; ++i) {
+		if (buf[i] != '\n')
+			continue;
+		if (buf[i + 1] == '\n')
+			return buf + i + 2;
+		if (i + 2 < n && buf[i + 1] == '\r' && buf[i + 2] == '\n')
+			return buf + i + 3;
 	}
 	return NULL;
 }
 
+/* Gather the CGI header of the output into head (*used bytes so far) from
+ * the n bytes at p. Once it is complete, pass its Content-Type to
+ * out->head() and the bytes of p behind it to out->body().
+ * Returns 1 once the header is complete, 0 while it is not, -1 if it is
+ * longer than PHP_HEAD_MAX.
+ */
+static int
+cgi_head(PhpOutput *out, char *head, size_t *used, const char *p, size_t n)
+{
+	size_t take = n < PHP_HEAD_MAX - *used ? n : PHP_HEAD_MAX - *used;
+	size_t before = *used, len;
+	const char *body;
+	char *line, *eol, *type = NULL;
+
+	memcpy(head + *used, p, take);
+	*used += take;
+	if ((body = find_body_start(head, *used)) == NULL)
+		return *used == PHP_HEAD_MAX ? -1 : 0;
+	len = (size_t)(body - head);
+	for (line = head; line < head + len; line = eol + 1) {
+		// Ends with an empty line: every line has its LF
+		eol = memchr(line, '\n', head + len - line);
+		if (strncasecmp(line, "Content-Type:", strlen("Content-Type:")) == 0) {
+			if (eol > line && eol[-1] == '\r')
+				eol[-1] = '\0';
+			else
+				*eol = '\0';
+			for (type = line + strlen("Content-Type:"); *type == ' ';)
+				type++;
+		}
+	}
+	out->head(out->arg, type);
+	if (n > len - before)
+		out->body(out->arg, p + (len - before), n - (len - before));
+	return 1;
+}
+
+/* Requests handed to php-fpm and not answered yet */
+static int php_limit = PHP_MAX_PENDING;
+static int php_pending = 0;
+
 void
-phptohtml(char *phpfile)
+phpSetLimit(int max)
+{
+	php_limit = max;
+}
+
+int
+phpAdmit(void)
+{
+	return php_limit <= 0
+		|| __atomic_load_n(&php_pending, __ATOMIC_RELAXED) < php_limit;
+}
+
+int
+phptohtml(char *phpfile, PhpOutput *out)
+{
+	int r;
+
+	__atomic_add_fetch(&php_pending, 1, __ATOMIC_RELAXED);
+	r = runPhp(phpfile, out);
+	__atomic_sub_fetch(&php_pending, 1, __ATOMIC_RELAXED);
+	return r;
+}
+
+static int
+runPhp(char *phpfile, PhpOutput *out)
 {
 	int fd = -1;
-	FILE *fpout = NULL;
 	size_t len = 0;
 	char abs_path[PATH_MAX];
-	int saw_headers = 0;
+	char head[PHP_HEAD_MAX];
+	size_t head_len = 0;
+	int saw_headers = 0, ended = 0;
 
 	FCGI_Header h;
 	printf("***BEGIN PHPTOHTML***\n");
-	fd = createSocket(9000);
+	if ((fd = createSocket(9000)) < 0)
+		return -1;
 	sendBeginRequest(fd, 10, FCGI_RESPONDER, FCGI_KEEP_CONN);
 	h.version = FCGI_VERSION_1;
 	h.type = FCGI_PARAMS;
@@ -63,7 +136,7 @@ phptohtml(char *phpfile)
 		perror("realpath");
 		if (fd >= 0)
 			close(fd);
-		return;
+		return -1;
 	}
 	addNameValuePair(&h, "REQUEST_METHOD", "GET");
 	addNameValuePair(&h, "SCRIPT_FILENAME", abs_path);
@@ -75,25 +148,32 @@ phptohtml(char *phpfile)
 
 	/* Send params record with content, then an empty params to terminate, then
 	 * empty STDIN */
-	writeSocket(
-		fd, &h, FCGI_HEADER_SIZE + (h.contentLength) + (h.paddingLength));
+	if (writeSocket(
+			fd, &h, FCGI_HEADER_SIZE + (h.contentLength) + (h.paddingLength))
+		< 0) {
+		close(fd);
+		return -1;
+	}
 	h.contentLength = 0;
 	h.paddingLength = 0;
-	writeSocket(fd,
-				&h,
-				FCGI_HEADER_SIZE
-					+ (h.contentLength)
-					+ (h.paddingLength)); /* FCGI_PARAMS end */
+	if (writeSocket(fd,
+					&h,
+					FCGI_HEADER_SIZE
+						+ (h.contentLength)
+						+ (h.paddingLength)) /* FCGI_PARAMS end */
+		< 0) {
+		close(fd);
+		return -1;
+	}
 	h.type = FCGI_STDIN;
-	writeSocket(fd,
-				&h,
-				FCGI_HEADER_SIZE
-					+ (h.contentLength)
-					+ (h.paddingLength)); /* FCGI_STDIN end */
-	if ((fpout = fopen(PHP_RESULT_FILE, "wb")) == NULL) {
-		perror("fopen PHP_RESULT_FILE");
+	if (writeSocket(fd,
+					&h,
+					FCGI_HEADER_SIZE
+						+ (h.contentLength)
+						+ (h.paddingLength)) /* FCGI_STDIN end */
+		< 0) {
 		close(fd);
-		return;
+		return -1;
 	}
 	do {
 		readData(fd, &h, &len);
@@ -105,29 +185,27 @@ phptohtml(char *phpfile)
 		printf("pad: %d\n", h.paddingLength);
 		printf("data: %.*s\n", h.contentLength, h.contentData);
 
-		if (h.type == FCGI_STDOUT && h.contentLength > 0) {
-			const char *p = h.contentData;
-			size_t n = (size_t)h.contentLength;
-			if (!saw_headers) {
-				const char *body = find_body_start(p, n);
-				if (body) {
-					saw_headers = 1;
-					size_t body_len = (size_t)(p + n - body);
-					if (body_len > 0)
-						fwrite(body, 1, body_len, fpout);
-				}
-				/* If only headers arrived, wait for next chunk */
-			} else {
-				fwrite(p, 1, n, fpout);
-			}
+		if (len != 0 && h.type == FCGI_STDOUT && h.contentLength > 0) {
+			/* Passed on as it comes: the client gets the start of the
+			 * page while the script runs */
+			if (saw_headers)
+				out->body(out->arg, h.contentData, h.contentLength);
+			else if ((saw_headers = cgi_head(out,
+											 head,
+											 &head_len,
+											 h.contentData,
+											 h.contentLength))
+					 < 0)
+				break;
 		}
+		if (len != 0 && h.type == FCGI_END_REQUEST)
+			ended = 1;
 		/* Ignore FCGI_STDERR and others for this POC */
 	} while ((len != 0) && (h.type != FCGI_END_REQUEST));
-	fflush(fpout);
-	fclose(fpout);
 	if (fd >= 0)
 		close(fd);
 	printf("***END PHPTOHTML***\n");
+	return ended && saw_headers == 1 ? 0 : -1;
 }
 
 static size_t
@@ -143,7 +221,11 @@ readSocket(int fd, char *buf, size_t len)
 		// try to read
 		do {
 			nb = read(fd, buf + readlen, len - readlen);
-		} while (nb == -1 && errno == EINTR);
+		} while (nb == -1
+				 && (errno == EINTR
+					 || (errno == EAGAIN
+						 && requestWait(fd, POLLIN, FCGI_TIMEOUT * 1000)
+							 > 0)));
 		if (nb > 0)
 			readlen += nb;
 	} while ((nb > 0) && (len != readlen));
@@ -173,21 +255,32 @@ readData(int fd, FCGI_Header *h, size_t *len)
 	}
 }
 
-static void
+static int
 writeSocket(int fd, FCGI_Header *h, unsigned int len)
 {
 	int w;
+	char *p = (char *)h;
 
 	h->contentLength = htons(h->contentLength);
 	h->paddingLength = htons(h->paddingLength);
 
 	while (len) {
-		// try to write
+		// try to write, php-fpm may be slow to read
 		do {
-			w = write(fd, h, len);
-		} while (w == -1 && errno == EINTR);
+			w = write(fd, p, len);
+		} while (w == -1
+				 && (errno == EINTR
+					 || (errno == EAGAIN
+						 && requestWait(fd, POLLOUT, FCGI_TIMEOUT * 1000)
+							 > 0)));
+		if (w <= 0) {
+			perror("write FastCGI");
+			return -1;
+		}
+		p += w;
 		len -= w;
 	}
+	return 0;
 }
 
 static void
@@ -255,10 +348,12 @@ sendBeginRequest(int fd, unsigned short requestId, unsigned short role,
 static int
 createSocket(int port)
 {
-	int fd;
+	int fd, err = 0;
+	socklen_t errlen = sizeof(err);
 	struct sockaddr_in serv_addr;
 
-	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+		< 0) {
 		perror("socket creation failed\n");
 		return (-1);
 	}
@@ -270,7 +365,16 @@ createSocket(int port)
 	serv_addr.sin_port = htons(port);
 
 	if (connect(fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+		/* Non-blocking: wait for the outcome without stalling the loop */
+		if (errno == EINPROGRESS
+			&& requestWait(fd, POLLOUT, FCGI_TIMEOUT * 1000) > 0
+			&& getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0
+			&& err == 0)
+			return fd;
+		if (err)
+			errno = err;
 		perror("connect failed\n");
+		close(fd);
 		return (-1);
 	}
 
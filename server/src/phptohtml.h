@@ -5,8 +5,41 @@
 
 #include "fastcgi.h"
 
-#define PHP_RESULT_FILE "/tmp/httpserver_php_result.html"
+/* Longest CGI header a script may send before its body */
+#ifndef PHP_HEAD_MAX
+#define PHP_HEAD_MAX 8192
+#endif
+
+/* Seconds without progress from php-fpm before giving up */
+#define FCGI_TIMEOUT 30
+
+/* Requests waiting on php-fpm above which new PHP requests are answered
+ * 503, per process. 0: no limit. See phpSetLimit().
+ */
+#ifndef PHP_MAX_PENDING
+#define PHP_MAX_PENDING 0
+#endif
+
+/* Where the output of a script goes as php-fpm sends it: head() once its
+ * CGI header is read, with its Content-Type (NULL if it has none), then
+ * body() with each piece of the body, in order.
+ */
+typedef struct php_output {
+	void (*head)(void *arg, const char *type);
+	void (*body)(void *arg, const char *buf, size_t len);
+	void *arg;
+} PhpOutput;
+
+/* Run phpfile through php-fpm and pass its output to out as it arrives,
+ * without waiting for the end of the script.
+ * Returns 0 once the script has ended, -1 if php-fpm failed: before the
+ * header (head() was not called) or during the body, then cut short.
+ */
+int phptohtml(char *phpfile, PhpOutput *out);
+
+void phpSetLimit(int max);
 
-void phptohtml(char *phpfile);
+/* 0 when PHP_MAX_PENDING requests already wait on php-fpm. */
+int phpAdmit(void);
 
 #endif
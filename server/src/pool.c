@@ -0,0 +1,174 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "pool.h"
+#include "util.h"
+
+/* Growable ring of items, protected by its own lock */
+typedef struct deque {
+	pthread_mutex_t lock;
+	void **items;
+	unsigned int cap;
+	unsigned int head; /* oldest item */
+	unsigned int len;
+} Deque;
+
+typedef struct worker_arg {
+	Pool *pool;
+	int id;
+	int cpu; /* -1: not pinned */
+} WorkerArg;
+
+struct pool {
+	int n;
+	Deque *deques;
+	pool_run run;
+	unsigned int next; /* round-robin target of poolPush() */
+
+	/* Items queued across all deques, idle workers sleep on cond */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int pending;
+};
+
+static void
+deque_push(Deque *d, void *item)
+{
+	pthread_mutex_lock(&d->lock);
+	if (d->len == d->cap) {
+		unsigned int cap = d->cap ? d->cap * 2 : 64;
+		void **items = emalloc(cap * sizeof(void *));
+		for (unsigned int i = 0; i < d->len; i++)
+			items[i] = d->items[(d->head + i) % d->cap];
+		free(d->items);
+		d->items = items;
+		d->cap = cap;
+		d->head = 0;
+	}
+	d->items[(d->head + d->len) % d->cap] = item;
+	d->len++;
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* Owner side: oldest item first */
+static void *
+deque_pop(Deque *d)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	if (d->len > 0) {
+		item = d->items[d->head];
+		d->head = (d->head + 1) % d->cap;
+		d->len--;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return item;
+}
+
+/* Thief side: newest item, away from the end the owner works on */
+static void *
+deque_steal(Deque *d)
+{
+	void *item = NULL;
+
+	if (pthread_mutex_trylock(&d->lock) != 0)
+		return NULL;
+	if (d->len > 0) {
+		d->len--;
+		item = d->items[(d->head + d->len) % d->cap];
+	}
+	pthread_mutex_unlock(&d->lock);
+	return item;
+}
+
+static void *
+take(Pool *p, int id)
+{
+	void *item;
+	int i;
+
+	if ((item = deque_pop(&p->deques[id])) != NULL)
+		return item;
+	for (i = 1; i < p->n; i++) {
+		if ((item = deque_steal(&p->deques[(id + i) % p->n])) != NULL)
+			return item;
+	}
+	return NULL;
+}
+
+static void *
+worker(void *arg)
+{
+	Pool *p = ((WorkerArg *)arg)->pool;
+	int id = ((WorkerArg *)arg)->id;
+	int cpu = ((WorkerArg *)arg)->cpu;
+	void *item;
+
+	free(arg);
+	if (cpu >= 0)
+		cpuPin(cpu);
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		while (p->pending == 0)
+			pthread_cond_wait(&p->cond, &p->lock);
+		pthread_mutex_unlock(&p->lock);
+
+		// Another worker may have been faster, go back to sleep then.
+		if ((item = take(p, id)) == NULL)
+			continue;
+		pthread_mutex_lock(&p->lock);
+		p->pending--;
+		pthread_mutex_unlock(&p->lock);
+		p->run(item);
+	}
+	return NULL;
+}
+
+Pool *
+poolCreate(int n, pool_run run, const int *cpus)
+{
+	Pool *p;
+	pthread_t tid;
+	WorkerArg *arg;
+	int i;
+
+	p = emalloc(sizeof(Pool));
+	memset(p, 0, sizeof(Pool));
+	p->n = n;
+	p->run = run;
+	p->deques = emalloc(n * sizeof(Deque));
+	memset(p->deques, 0, n * sizeof(Deque));
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->cond, NULL);
+
+	for (i = 0; i < n; i++)
+		pthread_mutex_init(&p->deques[i].lock, NULL);
+	for (i = 0; i < n; i++) {
+		arg = emalloc(sizeof(WorkerArg));
+		arg->pool = p;
+		arg->id = i;
+		arg->cpu = cpus ? cpus[i] : -1;
+		if (pthread_create(&tid, NULL, worker, arg) != 0) {
+			perror("pthread_create");
+			free(arg);
+			return NULL;
+		}
+		pthread_detach(tid);
+	}
+	return p;
+}
+
+void
+poolPush(Pool *p, void *item)
+{
+	deque_push(&p->deques[p->next++ % p->n], item);
+
+	pthread_mutex_lock(&p->lock);
+	p->pending++;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
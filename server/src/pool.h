@@ -0,0 +1,23 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/* Work-stealing thread pool.
+ * Each worker thread owns a deque of items. A worker serves its own deque
+ * oldest first; once it is empty, it steals the newest item of another
+ * worker's deque, so a worker stuck on a slow item does not hold back the
+ * items queued behind it.
+ */
+typedef struct pool Pool;
+
+typedef void (*pool_run)(void *item);
+
+/* Start n worker threads calling run on each pushed item. When cpus is not
+ * NULL, worker i is pinned to cpus[i] (see cpuPin()).
+ * Returns NULL on error.
+ */
+Pool *poolCreate(int n, pool_run run, const int *cpus);
+
+/* Queue an item on one of the workers (round-robin) and wake an idle one. */
+void poolPush(Pool *p, void *item);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cond.h"
+#include "range.h"
+
+#define CRLF "\r\n"
+
+/* Merge spans that overlap or touch into the first of them, keeping the
+ * order of the others. Returns the number left.
+ */
+static int
+merge(Span *spans, int n)
+{
+	off_t end;
+	int i, j, k;
+
+	for (i = 1; i < n; i++) {
+		for (j = 0; j < i; j++) {
+			if (spans[i].off > spans[j].off + spans[j].len
+				|| spans[j].off > spans[i].off + spans[i].len)
+				continue;
+			end = spans[i].off + spans[i].len;
+			if (end < spans[j].off + spans[j].len)
+				end = spans[j].off + spans[j].len;
+			if (spans[j].off > spans[i].off)
+				spans[j].off = spans[i].off;
+			spans[j].len = end - spans[j].off;
+			for (k = i; k + 1 < n; k++)
+				spans[k] = spans[k + 1];
+			n--;
+			// The grown span may now reach one it was apart from
+			i = 0;
+			break;
+		}
+	}
+	return n;
+}
+
+int
+rangeSpans(const Request *req, const struct stat *st, Span *spans)
+{
+	const ByteRange *r;
+	off_t size = st->st_size, first, last;
+	int i, n = 0;
+
+	if (req->nranges == 0)
+		return -1;
+	// The ranges are of the copy the client holds
+	if (!condRange(req, st))
+		return -1;
+	for (i = 0; i < req->nranges; i++) {
+		r = &req->ranges[i];
+		if (r->first < 0) {
+			// Suffix: the last bytes, the whole file if it is shorter
+			if (r->last == 0 || size == 0)
+				continue;
+			first = r->last >= size ? 0 : size - r->last;
+			last = size - 1;
+		} else {
+			if (r->first >= size)
+				continue;
+			first = r->first;
+			last = r->last < 0 || r->last >= size ? size - 1 : r->last;
+		}
+		spans[n].off = first;
+		spans[n].len = last - first + 1;
+		n++;
+	}
+	return merge(spans, n);
+}
+
+void
+rangeBoundary(char *buf)
+{
+	static __thread unsigned int count = 0;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	snprintf(buf,
+			 RANGE_BOUNDARY,
+			 "%08x%016llx%08x",
+			 (unsigned int)getpid(),
+			 (unsigned long long)ts.tv_sec * 1000000000ULL
+				 + (unsigned long long)ts.tv_nsec,
+			 ++count);
+}
+
+size_t
+rangePartHead(char *buf,
+			  size_t size,
+			  const Span *s,
+			  off_t total,
+			  const char *type,
+			  const char *boundary)
+{
+	int n;
+
+	if (s == NULL)
+		n = snprintf(buf, size, CRLF "--%s--" CRLF, boundary);
+	else
+		n = snprintf(buf,
+					 size,
+					 CRLF "--%s" CRLF "Content-Type: %s" CRLF
+						  "Content-Range: bytes %lld-%lld/%lld" CRLF CRLF,
+					 boundary,
+					 type,
+					 (long long)s->off,
+					 (long long)(s->off + s->len - 1),
+					 (long long)total);
+	return n < 0 ? 0 : (size_t)n;
+}
+
+off_t
+rangeMultipartLength(const Span *spans,
+					 int n,
+					 off_t total,
+					 const char *type,
+					 const char *boundary)
+{
+	off_t len = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		len += (off_t)rangePartHead(NULL, 0, &spans[i], total, type, boundary)
+			 + spans[i].len;
+	return len + (off_t)rangePartHead(NULL, 0, NULL, total, type, boundary);
+}
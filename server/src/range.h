@@ -0,0 +1,54 @@
+#ifndef _RANGE_H_
+#define _RANGE_H_
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#include "semantics.h"
+
+/* Byte ranges of a file (RFC 7233), resolved against its size. One range
+ * is answered as a 206 with Content-Range, several as multipart/byteranges
+ * whose parts are sent straight from the file, each behind its own part
+ * header.
+ */
+
+/* Longest boundary written by rangeBoundary(), its NUL included. */
+#define RANGE_BOUNDARY 33
+
+typedef struct span {
+	off_t off;
+	off_t len;
+} Span;
+
+/* Resolve the ranges req asks of the file st into spans, in the order
+ * requested; ranges that overlap or touch are merged into the first one.
+ * Returns the number of spans, 0 if none is satisfiable (416), or -1 if
+ * the whole file is to be sent: no Range, or an If-Range that does not
+ * match st.
+ */
+int rangeSpans(const Request *req, const struct stat *st, Span *spans);
+
+/* A boundary for a multipart/byteranges body, unlikely to be found in it. */
+void rangeBoundary(char *buf);
+
+/* Write into buf (size bytes) the delimiter and headers of part s of a
+ * file of size bytes, or the close delimiter if s is NULL. Returns their
+ * length, also when buf is too small (as snprintf()).
+ */
+size_t rangePartHead(char *buf,
+					 size_t size,
+					 const Span *s,
+					 off_t total,
+					 const char *type,
+					 const char *boundary);
+
+/* Content-Length of the multipart/byteranges body of the n spans. */
+off_t rangeMultipartLength(const Span *spans,
+						   int n,
+						   off_t total,
+						   const char *type,
+						   const char *boundary);
+
+#endif
@@ -0,0 +1,186 @@
+#include <sys/mman.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "ratelimit.h"
+
+/* Requests are counted in thousandths of a token so that the bucket
+ * refills by rps thousandths per millisecond.
+ */
+#define TOKEN 1000U
+
+typedef struct rate_entry {
+	uint32_t ip;	 /* network order, 0: free slot */
+	uint32_t conns;	 /* open connections */
+	uint64_t bucket; /* tokens (thousandths) << 32 | ms of last refill */
+} RateEntry;
+
+static RateEntry *table = NULL;
+static int max_conns = RATE_CONNS;
+static int max_rps = RATE_RPS;
+
+/* Milliseconds, truncated: only differences are used. The clock is the
+ * same in every process.
+ */
+static uint32_t
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint64_t
+full_bucket(uint32_t now)
+{
+	return (uint64_t)(2 * max_rps * TOKEN) << 32 | now;
+}
+
+static unsigned int
+hash(uint32_t ip)
+{
+	// Fibonacci hashing: consecutive addresses land far apart
+	return (unsigned int)((ip * 2654435769U) >> 16);
+}
+
+void
+rateSetLimits(int conns, int rps)
+{
+	max_conns = conns;
+	max_rps = rps;
+}
+
+int
+rateInit(void)
+{
+	if (max_conns <= 0 && max_rps <= 0)
+		return 0;
+	// Shared with the workers forked afterwards, zeroed: all slots free
+	table = mmap(NULL,
+				 RATE_SLOTS * sizeof(RateEntry),
+				 PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_ANONYMOUS,
+				 -1,
+				 0);
+	if (table == MAP_FAILED) {
+		perror("mmap rate table");
+		table = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static int
+idle(RateEntry *e, uint32_t now)
+{
+	uint64_t bucket = __atomic_load_n(&e->bucket, __ATOMIC_RELAXED);
+
+	return __atomic_load_n(&e->conns, __ATOMIC_RELAXED) == 0
+		&& now - (uint32_t)bucket > RATE_IDLE * 1000U;
+}
+
+/* Entry of ip, claimed if needed and claim is set. NULL when it has none
+ * and its probe window is full.
+ */
+static RateEntry *
+lookup(uint32_t ip, int claim)
+{
+	uint32_t now = now_ms(), cur;
+	unsigned int h = hash(ip), i;
+	RateEntry *e, *stale = NULL;
+
+	// Slots are never freed, only reused: ip cannot sit behind a free one
+	for (i = 0; i < RATE_PROBE; i++) {
+		e = &table[(h + i) & (RATE_SLOTS - 1)];
+		cur = __atomic_load_n(&e->ip, __ATOMIC_ACQUIRE);
+		if (cur == ip)
+			return e;
+		if (cur == 0 && !claim)
+			return NULL;
+		if (cur == 0) {
+			__atomic_store_n(&e->bucket, full_bucket(now), __ATOMIC_RELAXED);
+			if (__atomic_compare_exchange_n(
+					&e->ip, &cur, ip, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+				|| cur == ip)
+				return e;
+			continue;
+		}
+		if (stale == NULL && idle(e, now))
+			stale = e;
+	}
+	if (stale == NULL || !claim)
+		return NULL;
+	cur = __atomic_load_n(&stale->ip, __ATOMIC_ACQUIRE);
+	if (!idle(stale, now)
+		|| !__atomic_compare_exchange_n(
+			&stale->ip, &cur, ip, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return NULL;
+	__atomic_store_n(&stale->bucket, full_bucket(now), __ATOMIC_RELAXED);
+	return stale;
+}
+
+int
+rateConnect(struct in_addr addr)
+{
+	RateEntry *e;
+
+	if (table == NULL || max_conns <= 0 || addr.s_addr == 0
+		|| (e = lookup(addr.s_addr, 1)) == NULL)
+		return 1;
+	if (__atomic_add_fetch(&e->conns, 1, __ATOMIC_RELAXED)
+		> (uint32_t)max_conns) {
+		__atomic_sub_fetch(&e->conns, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	return 1;
+}
+
+void
+rateDisconnect(struct in_addr addr)
+{
+	RateEntry *e;
+	uint32_t n;
+
+	if (table == NULL || max_conns <= 0 || addr.s_addr == 0
+		|| (e = lookup(addr.s_addr, 0)) == NULL)
+		return;
+	// Not counted if the probe window was full on connect: stay at 0
+	n = __atomic_load_n(&e->conns, __ATOMIC_RELAXED);
+	while (n > 0
+		   && !__atomic_compare_exchange_n(
+			   &e->conns, &n, n - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+int
+rateRequest(struct in_addr addr)
+{
+	uint64_t old, new, tokens;
+	uint32_t now, last, elapsed;
+	RateEntry *e;
+
+	if (table == NULL || max_rps <= 0 || addr.s_addr == 0
+		|| (e = lookup(addr.s_addr, 1)) == NULL)
+		return 1;
+	now = now_ms();
+	old = __atomic_load_n(&e->bucket, __ATOMIC_RELAXED);
+	do {
+		tokens = old >> 32;
+		last = (uint32_t)old;
+		// Another process may have stamped a slightly later time
+		elapsed = now - last;
+		if (elapsed > UINT32_MAX / 2)
+			elapsed = 0;
+		tokens += (uint64_t)elapsed * (uint64_t)max_rps;
+		if (tokens > 2ULL * max_rps * TOKEN)
+			tokens = 2ULL * max_rps * TOKEN;
+		if (tokens < TOKEN)
+			return 0;
+		new = (tokens - TOKEN) << 32 | (elapsed ? now : last);
+	} while (!__atomic_compare_exchange_n(
+		&e->bucket, &old, new, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
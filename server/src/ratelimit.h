@@ -0,0 +1,55 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <netinet/in.h>
+
+/* Per client IP limits: open connections and requests per second.
+ * Counters live in a fixed open-addressing hash table mapped shared before
+ * the workers are forked, so every process and thread enforces the same
+ * limits. Entries are updated with atomic operations only; an entry idle
+ * for RATE_IDLE seconds is reused for another address. When the probe
+ * window of an address is full of live entries, it is not limited.
+ */
+#ifndef RATE_SLOTS
+#define RATE_SLOTS 65536 /* power of 2 */
+#endif
+
+#ifndef RATE_PROBE
+#define RATE_PROBE 16
+#endif
+
+#ifndef RATE_IDLE
+#define RATE_IDLE 60
+#endif
+
+/* Default limits, 0: none. Requests are a token bucket refilled at
+ * RATE_RPS tokens per second, holding at most 2 * RATE_RPS.
+ */
+#ifndef RATE_CONNS
+#define RATE_CONNS 256
+#endif
+
+#ifndef RATE_RPS
+#define RATE_RPS 0
+#endif
+
+/* Change the limits (0: none). Call before rateInit(). */
+void rateSetLimits(int conns, int rps);
+
+/* Map the table. Without it (error or no limits) nothing is limited.
+ * Returns 0, or -1 on error.
+ */
+int rateInit(void);
+
+/* Count a new connection from addr. Returns 0 if addr already has the
+ * maximum of connections open: the connection is then not counted.
+ */
+int rateConnect(struct in_addr addr);
+
+/* A connection counted by rateConnect() is closed. */
+void rateDisconnect(struct in_addr addr);
+
+/* Take a token for a request from addr. Returns 0 if it has none left. */
+int rateRequest(struct in_addr addr);
+
+#endif
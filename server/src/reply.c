@@ -0,0 +1,135 @@
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conf.h"
+#include "reply.h"
+#include "request.h"
+#include "semantics.h"
+
+/* Codes with a prebuilt response */
+static const int codes[] = { 400, 403, 404, 501, 505 };
+
+#define N_CODES (int)(sizeof(codes) / sizeof(codes[0]))
+
+typedef struct reply {
+	char *buf;
+	size_t head; /* bytes of the header, blank line included */
+	size_t len;
+} Reply;
+
+static Reply replies[N_HOSTS][N_CODES][N_CONNECTIONS];
+
+/* The error page of code for host into body, its length in *len: 0 if
+ * there is none. Returns 0, or -1 on error.
+ */
+static int
+load_page(int host, int code, char *body, size_t *len)
+{
+	char path[256];
+	struct stat st;
+	ssize_t n;
+	size_t got = 0;
+	int fd;
+
+	*len = 0;
+	snprintf(path,
+			 sizeof(path),
+			 SITES_FOLDER "/%s/" ERROR_PAGES "/%d.html",
+			 hosts[host],
+			 code);
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		if (errno == ENOENT || errno == ENOTDIR)
+			return 0;
+		perror(path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	if (!S_ISREG(st.st_mode) || st.st_size > REPLY_BODY_MAX) {
+		fprintf(stderr,
+				"%s: not a file of at most %d bytes, left out\n",
+				path,
+				REPLY_BODY_MAX);
+		close(fd);
+		return 0;
+	}
+	while (got < (size_t)st.st_size) {
+		if ((n = read(fd, body + got, (size_t)st.st_size - got)) < 0
+			&& errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += (size_t)n;
+	}
+	close(fd);
+	*len = got;
+	return 0;
+}
+
+static int
+build(Reply *r, const char *line, int connection, const char *body, size_t len)
+{
+	char head[256];
+	int n;
+
+	n = snprintf(head,
+				 sizeof(head),
+				 "%s\r\nConnection: %s\r\nContent-Length: %zu\r\n%s\r\n",
+				 line,
+				 connections[connection],
+				 len,
+				 len ? "Content-Type: text/html\r\n" : "");
+	if ((r->buf = malloc((size_t)n + len)) == NULL) {
+		perror("malloc");
+		return -1;
+	}
+	memcpy(r->buf, head, (size_t)n);
+	memcpy(r->buf + n, body, len);
+	r->head = (size_t)n;
+	r->len = (size_t)n + len;
+	return 0;
+}
+
+int
+replyInit(char *const status[])
+{
+	char body[REPLY_BODY_MAX];
+	size_t len;
+	int host, i, c;
+
+	for (host = 0; host < N_HOSTS; host++)
+		for (i = 0; i < N_CODES; i++) {
+			if (load_page(host, codes[i], body, &len) < 0)
+				return -1;
+			for (c = 0; c < N_CONNECTIONS; c++)
+				if (build(&replies[host][i][c], status[codes[i]], c, body, len)
+					< 0)
+					return -1;
+		}
+	return 0;
+}
+
+int
+replySend(int client, int host, int code, int connection, int head_only)
+{
+	const Reply *r;
+	int i;
+
+	for (i = 0; i < N_CODES && codes[i] != code; i++)
+		;
+	if (i == N_CODES || replies[0][i][0].buf == NULL)
+		return -1;
+	r = &replies[host < 0 ? DFLT_HOST : host][i][connection];
+	// Never freed: lent without release
+	writeBufferClient(client, r->buf, head_only ? r->head : r->len, NULL, NULL);
+	return 0;
+}
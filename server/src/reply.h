@@ -0,0 +1,30 @@
+#ifndef _REPLY_H_
+#define _REPLY_H_
+
+#include <stddef.h>
+
+/* Error responses built once at startup, before the workers are forked:
+ * status line, Connection, Content-Length and, if the host has one, a
+ * small HTML body read from SITES_FOLDER/<host>/ERROR_PAGES/<code>.html.
+ * Answering one is then a single buffer lent to the output queue, sent in
+ * one write with the responses pipelined around it.
+ */
+
+/* Error pages larger than this are left out: the response has no body. */
+#ifndef REPLY_BODY_MAX
+#define REPLY_BODY_MAX 4096
+#endif
+
+/* Build the responses, status lines taken from status[] (indexed by
+ * code). Returns 0, or -1 on error.
+ */
+int replyInit(char *const status[]);
+
+/* Queue the prebuilt response of code for host (-1: DFLT_HOST) and
+ * connection (enum connections) to client, with its body unless
+ * head_only (HEAD). Returns 0, or -1 if code has none: the caller builds
+ * it.
+ */
+int replySend(int client, int host, int code, int connection, int head_only);
+
+#endif
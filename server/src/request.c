@@ -1,171 +1,2101 @@
+#define _GNU_SOURCE /* accept4() */
+
 #include <arpa/inet.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coro.h"
+#include "cpu.h"
+#include "fdcache.h"
+#include "outq.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "request.h"
+#include "timer.h"
+#include "upgrade.h"
+#include "uring.h"
+
+#define STR_(x) #x
+#define STR(x) STR_(x)
+
+/* Sent as is to the clients over the admission limits. */
+static const char overloaded[] = "HTTP/1.1 503 Service Unavailable\r\n"
+								 "Retry-After: " STR(RETRY_AFTER) "\r\n"
+								 "Content-Length: 0\r\n"
+								 "Connection: close\r\n\r\n";
+
+/* Sent as is to the clients whose request is over HEADER_MAX or
+ * BODY_MAX.
+ */
+static const char header_too_large[] =
+	"HTTP/1.1 431 Request Header Fields Too Large\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n\r\n";
+
+static const char body_too_large[] = "HTTP/1.1 413 Content Too Large\r\n"
+									 "Content-Length: 0\r\n"
+									 "Connection: close\r\n\r\n";
+
+/* Sent as is to the clients over their per-address limits. */
+static const char too_many[] = "HTTP/1.1 429 Too Many Requests\r\n"
+							   "Retry-After: " STR(RETRY_AFTER) "\r\n"
+							   "Content-Length: 0\r\n"
+							   "Connection: close\r\n\r\n";
+
+/* listen() backlog, 0: net.core.somaxconn. See requestSetBacklog(). */
+#ifndef BACKLOG
+#define BACKLOG 0
+#endif
+
+/* Seconds the kernel keeps a new connection to itself waiting for the
+ * client's first bytes (TCP_DEFER_ACCEPT). Short: the header timeout only
+ * starts once the connection is accepted.
+ */
+#ifndef DEFER_ACCEPT
+#define DEFER_ACCEPT 1
+#endif
+
+/* Pending TCP Fast Open connections allowed per listening socket. */
+#ifndef FASTOPEN_QLEN
+#define FASTOPEN_QLEN 256
+#endif
+
+/* Backpressure: a connection is neither read nor served while more than
+ * OUT_HIGH bytes of its responses wait to be sent, and resumes once the
+ * client has taken them down to OUT_LOW. File ranges count for their
+ * length but hold no memory.
+ */
+#ifndef OUT_HIGH
+#define OUT_HIGH (256 * 1024)
+#endif
+
+#ifndef OUT_LOW
+#define OUT_LOW (64 * 1024)
+#endif
+
+/* Resolution of the connection timeouts, in milliseconds. */
+#ifndef TIMER_TICK
+#define TIMER_TICK 100
+#endif
+
+/* io_uring mode: what the SENDMSG in flight points to, kept until its
+ * completion.
+ */
+typedef struct send_state {
+	struct msghdr msg;
+	struct iovec iov[OUTQ_IOV];
+	char bounce[OUTQ_READ]; /* next bytes of a file range */
+} SendState;
+
+/* State kept by the event loop for each connected client.
+ * buf accumulates bytes until a full request has been received; bytes past
+ * its end are kept for the next one (pipelining). out queues the responses
+ * not sent yet, in order; the socket reports EPOLLOUT once it has room.
+ */
+typedef struct conn {
+	int fd;
+	struct sockaddr_in addr;
+	char *buf;
+	size_t len;
+	size_t cap;
+	size_t scanned;			/* of buf, searched for the end of the header */
+	size_t hlen;			/* of the header at the start of buf, 0: unknown */
+	size_t need;			/* header and body, known with hlen */
+	int reject;				/* 431 or 413: over HEADER_MAX or BODY_MAX */
+	int full;				/* reading stopped at HEADER_MAX + BODY_MAX */
+	long long last_active;	/* monotonic ms of last traffic */
+	unsigned int nrequests; /* requests served on this connection */
+	Timer timer;			/* deadline of the current state, conn_arm() */
+	long long req_start;	/* ms: first byte of the request being read */
+	long long body_start;	/* ms: end of its header, 0 before */
+	int broken;				/* a write failed or timed out */
+	Coro *co;				/* handler suspended in requestWait() */
+	int wait_fd;			/* what it waits for */
+	int timedout;			/* its wait expired */
+	uint32_t events;		/* epoll events to process (threaded mode) */
+	int busy;				/* owner, see conn_claim() (threaded mode) */
+	OutQueue out;			/* responses not sent yet */
+	int sending;			/* out is not empty, or a SEND is in flight */
+	long long write_start;	/* ms: first send of the batch */
+	size_t sent;			/* bytes of the batch handed to the socket */
+	size_t written;			/* of which the client acknowledged */
+	int paused;				/* over OUT_HIGH: not read until OUT_LOW */
+	int close_after;		/* close once out has been sent */
+	int rdhup;				/* peer closed its side */
+	/* io_uring mode */
+	int uring;		 /* driven by completions instead of epoll */
+	int inflight;	 /* submitted operations not completed yet */
+	int reading;	 /* a RECV is queued */
+	char *rbuf;		 /* receive buffer without provided buffers */
+	SendState *send; /* SENDMSG in flight */
+} Conn;
+
+static int listen_fd = -1;
+static int epoll_fd = -1;
+static int listen_backlog = BACKLOG;
+
+/* Connections indexed by socket fd, sized once to the fd limit so that
+ * pool threads can look them up while the acceptor adds new ones.
+ */
+static Conn **conns = NULL;
+static int nconns = 0;
+
+static request_handler loop_handler = NULL;
+
+/* The process loop runs handlers in a coroutine per connection, see
+ * requestWait(). coro_conn is the connection whose coroutine is running;
+ * waiters maps the other descriptors coroutines wait on (FastCGI) to their
+ * connection.
+ */
+static int use_coros = 0;
+static Conn *coro_conn = NULL;
+static Conn **waiters = NULL;
+
+/* Connection timeouts. Pool threads re-arm the timer of the connection
+ * they serve while the loop thread expires them: the lock is only taken
+ * in threaded mode.
+ */
+static TimerWheel wheel;
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static int threaded = 0;
+
+/* Sockets of closed connections whose MSG_ZEROCOPY buffers the kernel may
+ * still read, see conn_park(). The timer lock guards the list.
+ */
+typedef struct parked {
+	struct parked *next;
+	int fd;
+	long long until;
+	OutQueue out;
+} Parked;
+
+static Parked *parked = NULL;
+
+/* Graceful stop. The signal handlers only raise the requests, the loop
+ * acts on them between two batches of events, see loop_signals().
+ */
+static volatile sig_atomic_t drain_requested = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t report_requested = 0;
+static int draining = 0;
+static long long drain_deadline = 0;
+static int nopen = 0; /* connections not freed yet */
+
+/* Admission limits, see requestSetLimits(). */
+static int max_conns = MAX_CONNS;
+static int max_requests = MAX_REQUESTS;
+static int ninflight = 0; /* handlers running or suspended */
+static size_t zerocopy_min = 0; /* see requestSetZerocopy() */
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int
+set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* Time allowed to receive n bytes of a request part started at start:
+ * base seconds plus one per MIN_RATE bytes, at most max seconds.
+ */
+static long long
+read_deadline(long long start, int base, int max, size_t n)
+{
+	long long ms = base * 1000LL + (long long)n * 1000 / MIN_RATE;
+
+	if (ms > max * 1000LL)
+		ms = max * 1000LL;
+	return start + ms;
+}
+
+/* A response started at start must progress every WRITE_TIMEOUT (last:
+ * latest progress) and, past WRITE_TIMEOUT, average MIN_RATE bytes per
+ * second over the n bytes sent so far.
+ */
+static long long
+write_deadline(long long start, long long last, size_t n)
+{
+	long long t = start + (long long)n * 1000 / MIN_RATE;
+
+	if (t < start + WRITE_TIMEOUT * 1000LL)
+		t = start + WRITE_TIMEOUT * 1000LL;
+	if (t > last + WRITE_TIMEOUT * 1000LL)
+		t = last + WRITE_TIMEOUT * 1000LL;
+	return t;
+}
+
+/* Bytes sent on fd that the peer has not acknowledged yet. */
+static size_t
+unacked(int fd)
+{
+	int n;
+
+	if (ioctl(fd, SIOCOUTQ, &n) < 0 || n < 0)
+		return 0;
+	return (size_t)n;
+}
+
+/* Pending error of socket fd, 0 if none. */
+static int
+sock_error(int fd)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		return errno;
+	return err;
+}
+
+/* Client sockets are non-blocking: send as much as possible and wait for the
+ * socket to drain when the kernel buffer is full.
+ * Returns -1 if the send failed or the client reads too slowly. Progress is
+ * what the client acknowledged: the send buffer grows on its own.
+ */
+static int
+send_all(int fd, const char *buf, size_t len)
+{
+	size_t off = 0, acked, last_acked = 0;
+	long long start = now_ms(), last = start, left;
+
+	while (off < len) {
+		ssize_t n = send(fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			acked = off - unacked(fd);
+			if (acked > last_acked) {
+				last_acked = acked;
+				last = now_ms();
+			}
+			if ((left = write_deadline(start, last, acked) - now_ms()) <= 0)
+				return -1;
+			if (requestWait(fd, POLLOUT, (int)left) < 0 && errno != EINTR)
+				return -1;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+		off += (size_t)n;
+	}
+	return 0;
+}
+
+/* Send len bytes of file from off with send_all(), for sockets outside the
+ * loop.
+ */
+static void
+copy_file(int fd, int file, off_t off, size_t len)
+{
+	char buf[4096];
+	size_t want;
+	ssize_t n;
+
+	while (len > 0) {
+		want = len < sizeof(buf) ? len : sizeof(buf);
+		if ((n = pread(file, buf, want, off)) <= 0
+			|| send_all(fd, buf, (size_t)n) < 0)
+			break;
+		off += n;
+		len -= (size_t)n;
+	}
+}
+
+void
+requestSetBacklog(int backlog)
+{
+	listen_backlog = backlog;
+}
+
+void
+requestSetLimits(int maxconns, int maxrequests)
+{
+	if (maxconns > 0)
+		max_conns = maxconns;
+	if (maxrequests > 0)
+		max_requests = maxrequests;
+}
+
+void
+requestSetZerocopy(int on)
+{
+	outqSetZerocopy(on ? OUTQ_ZEROCOPY : 0);
+	zerocopy_min = on ? OUTQ_ZEROCOPY : 0;
+}
+
+size_t
+requestZerocopyMin(void)
+{
+	return zerocopy_min;
+}
+
+/* The kernel silently caps listen() backlogs to net.core.somaxconn. */
+static int
+somaxconn(void)
+{
+	FILE *f;
+	int n = SOMAXCONN;
+
+	if ((f = fopen("/proc/sys/net/core/somaxconn", "r")) != NULL) {
+		if (fscanf(f, "%d", &n) != 1 || n <= 0)
+			n = SOMAXCONN;
+		fclose(f);
+	}
+	return n;
+}
+
+/* New socket bound to port, with the options of a listener. */
+static int
+listen_socket(short int port, int reuseport)
+{
+	struct sockaddr_in addr;
+	int fd;
+	int opt = 1;
+	int defer = DEFER_ACCEPT;
+	int qlen = FASTOPEN_QLEN;
+
+	// Only handed to a new binary on purpose, see upgradeSpawn()
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+		perror("setsockopt");
+		// not fatal in practice, keep going
+	}
+
+	// Every worker binds its own socket on the same port, the kernel
+	// spreads incoming connections between them.
+	if (reuseport
+		&& setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		perror("setsockopt SO_REUSEPORT");
+		close(fd);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons((unsigned short)port);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	// Only wake us up once the client has sent its first bytes. A client
+	// that sends nothing is still handed over after DEFER_ACCEPT, the
+	// header timeout then applies.
+	if (setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer))
+		< 0)
+		perror("setsockopt TCP_DEFER_ACCEPT");
+
+	// Returning clients may send their request in the SYN. Needs bit 2 of
+	// net.ipv4.tcp_fastopen, ignored otherwise.
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) < 0)
+		perror("setsockopt TCP_FASTOPEN");
+	return fd;
+}
+
+int
+requestListen(short int port, int reuseport)
+{
+	static int warned = 0;
+	int fd, backlog, max;
+
+	// An inherited listener keeps its options and queued connections,
+	// listen() again only updates its backlog.
+	if ((fd = upgradeListener()) < 0
+		&& (fd = listen_socket(port, reuseport)) < 0)
+		return -1;
+
+	max = somaxconn();
+	backlog = listen_backlog > 0 ? listen_backlog : max;
+	if (backlog > max) {
+		if (!warned++)
+			fprintf(stderr,
+					"backlog %d above net.core.somaxconn, capped to %d\n",
+					backlog,
+					max);
+		backlog = max;
+	}
+	if (listen(fd, backlog) < 0) {
+		perror("listen");
+		close(fd);
+		return -1;
+	}
+
+	// accept() must never block the loop
+	if (set_nonblocking(fd) < 0) {
+		perror("fcntl");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Length of the header of the request at the start of c->buf, \r\n\r\n
+ * included, 0 if incomplete. The search resumes where the last one
+ * stopped.
+ */
+static size_t
+conn_header(Conn *c)
+{
+	size_t i;
+
+	if (c->hlen > 0)
+		return c->hlen;
+	for (i = c->scanned; i + 4 <= c->len; i++)
+		if (memcmp(c->buf + i, "\r\n\r\n", 4) == 0)
+			return c->hlen = i + 4;
+	// The terminator may straddle what comes next
+	c->scanned = c->len > 3 ? c->len - 3 : 0;
+	return 0;
+}
+
+/* Length of the first complete request in c->buf: its header plus the body
+ * announced by Content-Length, if any. 0 while more bytes are needed, or
+ * once it is over the limits: c->reject then tells the status.
+ */
+static size_t
+conn_frame(Conn *c)
+{
+	static const char name[] = "\r\ncontent-length:";
+	unsigned long long body = 0;
+	size_t hlen, i;
+	const char *p;
+
+	if (c->reject)
+		return 0;
+	if (c->need == 0) {
+		if ((hlen = conn_header(c)) == 0 || hlen > HEADER_MAX) {
+			if (hlen > HEADER_MAX || c->len > HEADER_MAX)
+				c->reject = 431;
+			return 0;
+		}
+		for (i = 0; i + sizeof(name) - 1 < hlen; i++) {
+			if (strncasecmp(c->buf + i, name, sizeof(name) - 1) == 0) {
+				p = c->buf + i + sizeof(name) - 1;
+				while (*p == ' ' || *p == '\t')
+					p++;
+				// Digits past BODY_MAX would only overflow
+				while (*p >= '0' && *p <= '9' && body <= BODY_MAX)
+					body = body * 10 + (unsigned long long)(*p++ - '0');
+				break;
+			}
+		}
+		if (body > BODY_MAX) {
+			c->reject = 413;
+			return 0;
+		}
+		c->need = hlen + (size_t)body;
+	}
+	return c->need <= c->len ? c->need : 0;
+}
+
+/* Answer a request over the limits and close once it is sent. What the
+ * client sends meanwhile is dropped.
+ */
+static void
+conn_reject(Conn *c)
+{
+	if (c->reject == 431)
+		writeDirectClient(c->fd,
+						  (char *)header_too_large,
+						  sizeof(header_too_large) - 1);
+	else
+		writeDirectClient(
+			c->fd, (char *)body_too_large, sizeof(body_too_large) - 1);
+	requestShutdownSocket(c->fd);
+	c->len = 0;
+}
+
+static int
+conns_init(void)
+{
+	struct rlimit rl;
+
+	if (conns)
+		return 0;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+		perror("getrlimit");
+		return -1;
+	}
+	nconns = rl.rlim_cur == RLIM_INFINITY ? 65536 : (int)rl.rlim_cur;
+	if ((conns = (Conn **)calloc(nconns, sizeof(Conn *))) == NULL
+		|| (waiters = (Conn **)calloc(nconns, sizeof(Conn *))) == NULL) {
+		perror("calloc conns");
+		return -1;
+	}
+	// Running out of descriptors would fail the files of the requests
+	// already accepted: refuse new clients before.
+	if (max_conns <= 0)
+		max_conns = nconns > 2 * (FD_RESERVE + FDCACHE_FILES)
+			? nconns - FD_RESERVE - FDCACHE_FILES
+			: nconns;
+	timerWheelInit(&wheel, (unsigned long long)(now_ms() / TIMER_TICK));
+	return 0;
+}
+
+static Conn *
+conn_new(int fd, struct sockaddr_in *addr)
+{
+	Conn *c;
+
+	if (fd >= nconns) {
+		fprintf(stderr, "conn_new: fd %d above the fd limit\n", fd);
+		return NULL;
+	}
+
+	if ((c = (Conn *)malloc(sizeof(Conn))) == NULL) {
+		perror("malloc conn");
+		return NULL;
+	}
+	c->fd = fd;
+	c->addr = *addr;
+	c->buf = NULL;
+	c->len = 0;
+	c->cap = 0;
+	c->scanned = 0;
+	c->hlen = 0;
+	c->need = 0;
+	c->reject = 0;
+	c->full = 0;
+	c->last_active = now_ms();
+	c->nrequests = 0;
+	timerInit(&c->timer);
+	c->req_start = c->last_active;
+	c->body_start = 0;
+	c->broken = 0;
+	c->co = NULL;
+	c->wait_fd = -1;
+	c->timedout = 0;
+	c->events = 0;
+	c->busy = 0;
+	outqInit(&c->out);
+	c->sending = 0;
+	c->write_start = 0;
+	c->sent = 0;
+	c->written = 0;
+	c->paused = 0;
+	c->close_after = 0;
+	c->rdhup = 0;
+	c->uring = 0;
+	c->inflight = 0;
+	c->reading = 0;
+	c->rbuf = NULL;
+	c->send = NULL;
+	conns[fd] = c;
+	__atomic_add_fetch(&nopen, 1, __ATOMIC_RELAXED);
+	return c;
+}
+
+static void
+conn_free(Conn *c)
+{
+	rateDisconnect(c->addr.sin_addr);
+	free(c->buf);
+	outqClear(&c->out);
+	free(c->rbuf);
+	free(c->send);
+	free(c);
+	__atomic_sub_fetch(&nopen, 1, __ATOMIC_RELAXED);
+}
+
+static void
+timers_lock(void)
+{
+	if (threaded)
+		pthread_mutex_lock(&timer_lock);
+}
+
+static void
+timers_unlock(void)
+{
+	if (threaded)
+		pthread_mutex_unlock(&timer_lock);
+}
+
+/* Threaded mode: c->busy is 0 while no thread owns c, 1 while one does, 2
+ * once events came for it meanwhile. Only the loop thread takes ownership,
+ * to hand c to a pool thread or to close it; a pool thread gives it back
+ * once c is armed again, and does not touch it afterwards.
+ * Returns 1 if the loop thread now owns c.
+ */
+static int
+conn_claim(Conn *c)
+{
+	int idle = 0;
+
+	return __atomic_compare_exchange_n(
+		&c->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* Loop thread: events came for c. Returns 1 if they are for a pool thread
+ * to serve, 0 if the thread owning c serves them before giving it back.
+ */
+static int
+conn_take(Conn *c, uint32_t events)
+{
+	int busy = __atomic_load_n(&c->busy, __ATOMIC_RELAXED);
+
+	__atomic_fetch_or(&c->events, events, __ATOMIC_RELEASE);
+	while (!__atomic_compare_exchange_n(&c->busy,
+										&busy,
+										busy == 0 ? 1 : 2,
+										0,
+										__ATOMIC_ACQ_REL,
+										__ATOMIC_RELAXED))
+		;
+	return busy == 0;
+}
+
+static void
+conn_arm_at(Conn *c, long long t)
+{
+	timers_lock();
+	timerAdd(&wheel, &c->timer, (unsigned long long)(t / TIMER_TICK + 1));
+	timers_unlock();
+}
+
+/* Arm the connection timer with the limit of what it is waiting for. */
+static void
+conn_arm(Conn *c)
+{
+	long long t;
+	size_t hlen;
+
+	if (c->sending) {
+		t = write_deadline(c->write_start,
+						   c->last_active > c->write_start ? c->last_active
+														   : c->write_start,
+						   c->written);
+	} else if (c->len == 0 && c->nrequests > 0) {
+		t = c->last_active + KEEPALIVE_TIMEOUT * 1000LL;
+	} else if ((hlen = conn_header(c)) == 0) {
+		t = read_deadline(
+			c->req_start, HEADER_TIMEOUT, HEADER_TIMEOUT_MAX, c->len);
+	} else {
+		if (c->body_start == 0)
+			c->body_start = now_ms();
+		t = read_deadline(
+			c->body_start, BODY_TIMEOUT, BODY_TIMEOUT_MAX, c->len - hlen);
+	}
+	conn_arm_at(c, t);
+}
+
+/* Close sock at once, dropping what its send queue holds, then release
+ * the buffers of q the kernel was still reading.
+ */
+static void
+socket_reset(int sock, OutQueue *q)
+{
+	struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+
+	if (setsockopt(sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) < 0)
+		perror("setsockopt SO_LINGER");
+	close(sock);
+	outqClear(q);
+}
+
+/* Closing the socket of c would leave the kernel reading buffers that are
+ * then released: it stays open, out of epoll, until the completions of
+ * their sends arrive. timers_run() reaps them, and resets the socket once
+ * ZEROCOPY_LINGER passes.
+ */
+static void
+conn_park(Conn *c)
+{
+	Parked *p;
+
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	outqDrop(&c->out);
+	if ((p = (Parked *)malloc(sizeof(Parked))) == NULL) {
+		perror("malloc");
+		socket_reset(c->fd, &c->out);
+		return;
+	}
+	// The client still sees the end of the response
+	shutdown(c->fd, SHUT_WR);
+	p->fd = c->fd;
+	p->until = now_ms() + ZEROCOPY_LINGER * 1000LL;
+	p->out = c->out;
+	outqInit(&c->out);
+	timers_lock();
+	p->next = parked;
+	parked = p;
+	timers_unlock();
+}
+
+/* Close the parked sockets the kernel is done with, or that waited too
+ * long.
+ */
+static void
+parked_run(void)
+{
+	Parked *list, *p, *keep = NULL;
+	long long now = now_ms();
+
+	timers_lock();
+	list = parked;
+	parked = NULL;
+	timers_unlock();
+	while ((p = list) != NULL) {
+		list = p->next;
+		outqReap(&p->out, p->fd);
+		if (!outqEmpty(&p->out) && now < p->until) {
+			p->next = keep;
+			keep = p;
+			continue;
+		}
+		socket_reset(p->fd, &p->out);
+		free(p);
+	}
+	if (keep == NULL)
+		return;
+	timers_lock();
+	for (p = keep; p->next; p = p->next)
+		;
+	p->next = parked;
+	parked = keep;
+	timers_unlock();
+}
+
+static void
+conn_close(Conn *c)
+{
+	timers_lock();
+	timerCancel(&c->timer);
+	timers_unlock();
+	if (c->fd >= 0) {
+		conns[c->fd] = NULL;
+		// Operations still queued in the ring hold a reference on the
+		// socket: shutdown() makes them complete.
+		if (c->uring)
+			shutdown(c->fd, SHUT_RDWR);
+		if (outqPinned(&c->out))
+			conn_park(c);
+		else
+			close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/* Answer a client right after accept, without reading its request. The
+ * bytes already received are discarded first: closing with unread data
+ * would reset the connection before the client reads the answer.
+ */
+static void
+refuse_client(int fd, const char *resp, size_t len)
+{
+	char scratch[4096];
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		if (recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) <= 0)
+			break;
+	}
+	send(fd, resp, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+}
+
+/* Apply the process and per-address connection limits to a new client.
+ * Returns 0 once it has been refused and closed.
+ */
+static int
+admit_client(int fd, struct sockaddr_in *addr)
+{
+	if (__atomic_load_n(&nopen, __ATOMIC_RELAXED) >= max_conns) {
+		refuse_client(fd, overloaded, sizeof(overloaded) - 1);
+		return 0;
+	}
+	if (!rateConnect(addr->sin_addr)) {
+		refuse_client(fd, too_many, sizeof(too_many) - 1);
+		return 0;
+	}
+	return 1;
+}
+
+static void
+accept_clients(uint32_t flags)
+{
+	int client_fd;
+	struct sockaddr_in client_addr;
+	socklen_t addrlen;
+	struct epoll_event ev;
+	Conn *c;
+
+	// Edge-triggered: drain the accept queue.
+	while (1) {
+		addrlen = sizeof(client_addr);
+		client_fd = accept4(listen_fd,
+							(struct sockaddr *)&client_addr,
+							&addrlen,
+							SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (client_fd < 0) {
+			// The client gave up while queued: go on with the others
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4");
+			return;
+		}
+
+		if (!admit_client(client_fd, &client_addr))
+			continue;
+		if (!conn_new(client_fd, &client_addr)) {
+			rateDisconnect(client_addr.sin_addr);
+			close(client_fd);
+			continue;
+		}
+
+		// Until its request header is in: HEADER_TIMEOUT. Edge-triggered,
+		// EPOLLOUT only fires once a send has run out of room: it stays on.
+		conn_arm(conns[client_fd]);
+		ev.events = EPOLLIN | EPOLLRDHUP | flags
+			| (flags & EPOLLET ? EPOLLOUT : 0);
+		ev.data.fd = client_fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+			perror("epoll_ctl");
+			c = conns[client_fd];
+			conn_close(c);
+			conn_free(c);
+			continue;
+		}
+	}
+}
+
+/* Make room for n more bytes (plus the terminating NULL) in c->buf. */
+static int
+conn_reserve(Conn *c, size_t n)
+{
+	size_t cap = c->cap ? c->cap : 4096;
+	char *nbuf;
+
+	if (c->len + n + 1 <= c->cap)
+		return 0;
+	while (c->len + n + 1 > cap)
+		cap *= 2;
+	if ((nbuf = (char *)realloc(c->buf, cap)) == NULL) {
+		perror("realloc");
+		return -1;
+	}
+	c->buf = nbuf;
+	c->cap = cap;
+	return 0;
+}
+
+/* Read everything available on the connection.
+ * Returns 0 when no more bytes are available for now, 1 when the peer has
+ * closed its side, -1 on error.
+ */
+static int
+conn_read(Conn *c)
+{
+	while (1) {
+		// Over the limits: dropped until the answer is sent
+		if (c->reject)
+			c->len = 0;
+		// The first request is complete: the rest waits for it to be
+		// served
+		else if (c->len >= HEADER_MAX + BODY_MAX) {
+			c->full = 1;
+			return 0;
+		}
+		// grow buffer if needed
+		if (c->len + 1 >= c->cap && conn_reserve(c, 1) < 0)
+			return -1;
+
+		ssize_t n = recv(c->fd, c->buf + c->len, c->cap - c->len - 1, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			// read error
+			perror("recv");
+			return -1;
+		}
+		if (n == 0) {
+			// client closed its side of the connection
+			return 1;
+		}
+		// First bytes of a new request on a kept-alive connection
+		if (c->len == 0 && c->nrequests > 0)
+			c->req_start = now_ms();
+		c->len += (size_t)n;
+		conn_frame(c);
+	}
+}
+
+/* Hand the first n buffered bytes (one request) over to the handler as a
+ * message. The bytes that follow stay buffered for the next request.
+ */
+static void
+dispatch(Conn *c, size_t n, request_handler handler)
+{
+	char *buf = c->buf;
+	size_t rest = c->len - n;
+
+	message *m = (message *)malloc(sizeof(message));
+	if (!m) {
+		perror("malloc message");
+		conn_close(c);
+		return;
+	}
+
+	m->clientAddress =
+		(struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
+	if (!m->clientAddress) {
+		perror("malloc clientAddress");
+		free(m);
+		conn_close(c);
+		return;
+	}
+	*(m->clientAddress) = c->addr;
+
+	// The message now owns the bytes, start a fresh buffer for the next
+	// one with what was pipelined behind this request.
+	c->buf = NULL;
+	c->len = 0;
+	c->cap = 0;
+	c->scanned = 0;
+	c->hlen = 0;
+	c->need = 0;
+	if (rest > 0) {
+		if (conn_reserve(c, rest) < 0) {
+			free(m->clientAddress);
+			free(m);
+			free(buf);
+			conn_close(c);
+			return;
+		}
+		memcpy(c->buf, buf + n, rest);
+		c->len = rest;
+	}
+
+	// Null-terminate for convenience
+	buf[n] = '\0';
+	m->buf = buf;
+	m->len = (unsigned int)n;
+	// clientId = socket fd
+	m->clientId = (unsigned int)c->fd;
+	m->keepAlive = ++c->nrequests < KEEPALIVE_MAX && !draining;
+	// Timeouts of a pipelined request start once this one is served
+	c->body_start = 0;
+
+	if (!rateRequest(c->addr.sin_addr)) {
+		writeDirectClient(c->fd, (char *)too_many, sizeof(too_many) - 1);
+		requestShutdownSocket(c->fd);
+		freeRequest(m);
+	} else if (max_requests > 0
+			   && __atomic_load_n(&ninflight, __ATOMIC_RELAXED)
+					  >= max_requests) {
+		requestShed(c->fd);
+		freeRequest(m);
+	} else {
+		__atomic_add_fetch(&ninflight, 1, __ATOMIC_RELAXED);
+		handler(m);
+		__atomic_sub_fetch(&ninflight, 1, __ATOMIC_RELAXED);
+	}
+	c->last_active = now_ms();
+	c->req_start = c->last_active;
+}
+
+/* Queue bytes written by the handler. */
+static void
+conn_write(Conn *c, const char *buf, size_t len)
+{
+	// Output of a broken connection is dropped, the loop closes it.
+	if (!c->broken && outqWrite(&c->out, buf, len) < 0)
+		c->broken = 1;
+}
+
+/* Send what the queue holds as far as the socket takes it, without
+ * waiting. Returns 0 once it is empty, 1 while bytes are left for the next
+ * EPOLLOUT or buffers sent with MSG_ZEROCOPY wait for their completion
+ * (EPOLLERR), -1 if the connection broke.
+ */
+static int
+conn_flush(Conn *c)
+{
+	long long now;
+	size_t acked, left;
+	ssize_t n = 0;
+
+	if (c->fd < 0 || c->broken)
+		return -1;
+	if (c->out.zc_head)
+		outqReap(&c->out, c->fd);
+	if (outqEmpty(&c->out) && !c->sending)
+		return 0;
+	if (c->out.bytes > 0 && (n = outqSend(&c->out, c->fd)) < 0) {
+		// What the kernel still reads is released once the socket is
+		// closed, see conn_park()
+		outqDrop(&c->out);
+		c->broken = 1;
+		return -1;
+	}
+	now = now_ms();
+	if (!c->sending) {
+		c->sending = 1;
+		c->write_start = now;
+		c->last_active = now;
+		c->sent = 0;
+		c->written = 0;
+	}
+	c->sent += (size_t)n;
+	if (outqEmpty(&c->out)) {
+		c->sending = 0;
+		c->last_active = now;
+		return 0;
+	}
+	// Progress is what the client acknowledged: the send buffer grows on
+	// its own.
+	left = unacked(c->fd);
+	acked = c->sent > left ? c->sent - left : 0;
+	if (acked > c->written) {
+		c->written = acked;
+		c->last_active = now;
+	}
+	if (c->out.bytes > OUT_HIGH)
+		c->paused = 1;
+	return 1;
+}
+
+/* Run the handler on every complete request buffered, in order, until
+ * their responses reach OUT_HIGH. Returns 1 if requests are left for once
+ * the client has read them.
+ */
+static int
+dispatch_all(Conn *c, request_handler handler)
+{
+	size_t n;
+
+	while (c->fd >= 0 && !c->close_after && !c->broken
+		   && (n = conn_frame(c)) > 0) {
+		if (c->out.bytes > OUT_HIGH)
+			return 1;
+		dispatch(c, n, handler);
+	}
+	if (c->fd >= 0 && c->reject && !c->close_after && !c->broken)
+		conn_reject(c);
+	return 0;
+}
+
+/* Coroutine body: serve every request received so far, an incomplete one
+ * waits for more bytes. Pipelined responses leave together.
+ */
+static void
+conn_serve(void *arg)
+{
+	Conn *c = (Conn *)arg;
+
+	while (dispatch_all(c, loop_handler) && conn_flush(c) == 0)
+		;
+	conn_flush(c);
+}
+
+/* Run the connection coroutine until it waits or ends.
+ * Returns 1 once it has ended.
+ */
+static int
+conn_resume(Conn *c)
+{
+	int done;
+
+	coro_conn = c;
+	done = coroResume(c->co);
+	coro_conn = NULL;
+	if (done)
+		c->co = NULL;
+	return done;
+}
+
+/* Once its requests are served: close the connection or arm its timer.
+ * Returns -1 once it has been closed and freed.
+ */
+static int
+conn_done(Conn *c)
+{
+	// Its responses are out and nothing more will come from this client,
+	// or it stopped reading them.
+	if (c->fd >= 0
+		&& (c->broken
+			|| (outqEmpty(&c->out)
+				&& (c->rdhup || c->close_after
+					|| (draining && c->len == 0 && c->nrequests > 0)))))
+		conn_close(c);
+	// The handler may have closed it with requestShutdownSocket().
+	if (c->fd < 0) {
+		conn_free(c);
+		return -1;
+	}
+	conn_arm(c);
+	return 0;
+}
+
+/* Read what the client sent and run the handler on complete requests.
+ * Returns 0 while the connection stays open or its handler waits, -1 once
+ * it has been closed and freed.
+ */
+static int
+conn_process(Conn *c, uint32_t events)
+{
+	int r;
+
+	// EPOLLERR also tells of MSG_ZEROCOPY completions on the error queue:
+	// only a socket error ends the connection.
+	if (events & EPOLLERR && c->out.zc_on && sock_error(c->fd) == 0)
+		events &= ~EPOLLERR;
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		conn_close(c);
+		return conn_done(c);
+	}
+again:
+	if (!c->sending)
+		c->last_active = now_ms();
+	// Responses waiting for room in the socket go out first. A client that
+	// does not take them is not read either.
+	if (conn_flush(c) < 0 || c->close_after
+		|| (c->paused && c->out.bytes > OUT_LOW))
+		return conn_done(c);
+	c->paused = 0;
+	if ((r = conn_read(c)) < 0) {
+		conn_close(c);
+		return conn_done(c);
+	}
+	if (r == 1 || events & EPOLLRDHUP)
+		c->rdhup = 1;
+
+	// In a coroutine, a handler that would block lets the loop go on.
+	if (use_coros && conn_frame(c) > 0
+		&& (c->co = coroCreate(conn_serve, c)) != NULL) {
+		if (!conn_resume(c))
+			return 0;
+	} else {
+		conn_serve(c);
+	}
+	if (conn_done(c) < 0)
+		return -1;
+	// Reading stopped with HEADER_MAX + BODY_MAX buffered: the rest now
+	if (c->full) {
+		c->full = 0;
+		goto again;
+	}
+	return 0;
+}
+
+#ifdef WITH_URING
+static void uring_wake(Conn *c);
+static void uring_stop_accept(void);
+#endif
+
+/* Resume a suspended handler once its wait is over. What the client sent
+ * meanwhile is read afterwards: its socket is edge-triggered.
+ */
+static void
+conn_wake(Conn *c)
+{
+#ifdef WITH_URING
+	if (c->uring) {
+		uring_wake(c);
+		return;
+	}
+#endif
+	if (conn_resume(c) && conn_done(c) == 0)
+		conn_process(c, 0);
+}
+
+/* Close the connections whose deadline has passed. */
+static void
+timers_run(void)
+{
+	Timer expired, *t;
+	Conn *c;
+
+	timers_lock();
+	timerAdvance(&wheel, (unsigned long long)(now_ms() / TIMER_TICK), &expired);
+	while ((t = timerPop(&expired)) != NULL) {
+		c = (Conn *)((char *)t - offsetof(Conn, timer));
+		// Owned by a pool thread: only the owner may close it. It re-arms
+		// the timer once done, unless it is already past that: tried
+		// again next tick.
+		if (threaded && !conn_claim(c)) {
+			timerAdd(&wheel, &c->timer, wheel.now + 1);
+			continue;
+		}
+		timers_unlock();
+		if (c->co) {
+			// Its handler is waiting: the wait fails.
+			c->timedout = 1;
+			conn_wake(c);
+		} else {
+			conn_close(c);
+			// io_uring: freed by the last completion instead
+			if (c->inflight == 0)
+				conn_free(c);
+		}
+		timers_lock();
+	}
+	timers_unlock();
+	parked_run();
+}
+
+static void
+on_signal(int sig)
+{
+	if (sig == SIGUSR2)
+		upgrade_requested = 1;
+	else if (sig == SIGUSR1)
+		report_requested = 1;
+	else
+		drain_requested = 1;
+}
+
+static void
+signals_init(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGQUIT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+/* Counters of this process: on SIGUSR1, and once it starts draining. */
+static void
+report(void)
+{
+	unsigned long hits, misses;
+
+	fdcacheCounters(&hits, &misses);
+	printf("Process %d file cache: %lu hits, %lu misses\n",
+		   (int)getpid(),
+		   hits,
+		   misses);
+	fflush(stdout);
+}
+
+/* Stop accepting and close the connections waiting for a request. Those
+ * in the middle of one are closed once answered.
+ */
+static void
+drain_start(void)
+{
+	Conn *c;
+	int fd;
+
+	draining = 1;
+	drain_deadline = now_ms() + DRAIN_TIMEOUT * 1000LL;
+	report();
+	printf("Process %d draining %d connections\n",
+		   (int)getpid(),
+		   __atomic_load_n(&nopen, __ATOMIC_RELAXED));
+	if (epoll_fd >= 0)
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+#ifdef WITH_URING
+	uring_stop_accept();
+#endif
+	// Other processes keep their own descriptor of the listener
+	close(listen_fd);
+	listen_fd = -1;
+
+	// Connections owned by a pool thread or a suspended handler are left
+	// to finish their request.
+	for (fd = 0; fd < nconns; fd++) {
+		if ((c = conns[fd]) == NULL || !conn_claim(c))
+			continue;
+		// A request may be waiting behind the last edge: serve it first
+		if (!c->co && !c->sending && !c->uring && conn_process(c, 0) < 0)
+			continue;
+		// New clients have their request under way
+		if (c->fd >= 0 && !c->co && !c->sending && c->len == 0
+			&& c->nrequests > 0) {
+			conn_close(c);
+			if (c->inflight == 0) {
+				conn_free(c);
+				continue;
+			}
+		}
+		__atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/* Act on the signals received since the last call.
+ * Returns 1 once the loop has drained and must return.
+ */
+static int
+loop_signals(void)
+{
+	if (upgrade_requested) {
+		upgrade_requested = 0;
+		if (!draining && upgradeSpawn(&listen_fd, 1) > 0)
+			drain_requested = 1;
+	}
+	if (report_requested) {
+		report_requested = 0;
+		report();
+	}
+	if (drain_requested && !draining)
+		drain_start();
+	return draining
+		&& (__atomic_load_n(&nopen, __ATOMIC_RELAXED) == 0
+			|| now_ms() >= drain_deadline);
+}
+
+static int
+loop_init(int fd, request_handler handler)
+{
+	struct epoll_event ev;
 
-#include "request.h"
+	listen_fd = fd;
+	loop_handler = handler;
+	if (conns_init() < 0)
+		return -1;
 
-#ifndef BACKLOG
-#define BACKLOG MAXCLIENT
+	if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = listen_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+		perror("epoll_ctl");
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef WITH_URING
+/* io_uring backend: accept, receive and send are submitted to a ring and
+ * the loop only reacts to their completions, one io_uring_enter() per
+ * batch instead of a system call per operation.
+ */
+
+#ifndef URING_ENTRIES
+#define URING_ENTRIES 256
 #endif
 
-static int listen_fd = -1;
+#ifndef URING_BUFS
+#define URING_BUFS 256 /* power of 2 */
+#endif
 
-static int
-init_server(short int port)
-{
+#ifndef URING_BUF_SIZE
+#define URING_BUF_SIZE 4096
+#endif
+
+/* Accepts kept queued, each with the address its client is written to. */
+#ifndef URING_ACCEPTS
+#define URING_ACCEPTS 8
+#endif
+
+#define URING_BGID 1
+
+// Operation kind, kept in the low bits of user_data next to the Conn, or
+// next to the slot of an accept.
+enum { UR_ACCEPT, UR_RECV, UR_SEND, UR_TICK, UR_CANCEL, UR_POLL };
+#define UR_OP_MASK 7
+#define UR_SLOT_SHIFT 3
+
+static Uring ring;
+static UringBufs rbufs;
+static int have_bufs = 0;
+static int multishot_recv = 1;
+
+/* A multishot accept writes every peer to the same address, overwritten
+ * before the completions of a batch are read: one accept per slot.
+ */
+static struct accept_slot {
 	struct sockaddr_in addr;
-	int opt = 1;
+	socklen_t addrlen;
+} accepts[URING_ACCEPTS];
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (listen_fd < 0) {
-		perror("socket");
-		return -1;
+static struct __kernel_timespec tick = { .tv_sec = 0,
+										  .tv_nsec = TIMER_TICK * 1000000 };
+
+static struct io_uring_sqe *
+uring_sqe(Conn *c, int op)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uringGetSqe(&ring)) == NULL) {
+		perror("io_uring_enter");
+		return NULL;
 	}
+	sqe->user_data = (uint64_t)(uintptr_t)c | (uint64_t)op;
+	if (c)
+		c->inflight++;
+	return sqe;
+}
 
-	if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))
-		< 0) {
-		perror("setsockopt");
-		// not fatal in practice, keep going
+static void
+uring_accept(int slot)
+{
+	struct accept_slot *a = &accepts[slot];
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(NULL, UR_ACCEPT)) == NULL)
+		return;
+	sqe->user_data |= (uint64_t)slot << UR_SLOT_SHIFT;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = listen_fd;
+	a->addrlen = sizeof(a->addr);
+	sqe->addr = (unsigned long)&a->addr;
+	sqe->addr2 = (unsigned long)&a->addrlen;
+	// Blocking sockets: the ring waits for room itself, O_NONBLOCK would
+	// fail a SENDMSG the socket cannot take at once with -EAGAIN.
+	sqe->accept_flags = SOCK_CLOEXEC;
+}
+
+/* Draining: cancel the pending accepts, ours have no Conn. */
+static void
+uring_stop_accept(void)
+{
+	struct io_uring_sqe *sqe;
+	int slot;
+
+	for (slot = 0; ring.sqes != NULL && slot < URING_ACCEPTS; slot++) {
+		if ((sqe = uring_sqe(NULL, UR_CANCEL)) == NULL)
+			return;
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = (uint64_t)slot << UR_SLOT_SHIFT | UR_ACCEPT;
 	}
+}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	addr.sin_port = htons((unsigned short)port);
+static void
+uring_tick(void)
+{
+	struct io_uring_sqe *sqe;
 
-	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind");
-		close(listen_fd);
-		listen_fd = -1;
-		return -1;
+	if ((sqe = uring_sqe(NULL, UR_TICK)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (unsigned long)&tick;
+	sqe->len = 1;
+}
+
+static void
+uring_recv(Conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!have_bufs && c->rbuf == NULL
+		&& (c->rbuf = (char *)malloc(URING_BUF_SIZE)) == NULL) {
+		perror("malloc rbuf");
+		conn_close(c);
+		return;
 	}
+	if ((sqe = uring_sqe(c, UR_RECV)) == NULL) {
+		conn_close(c);
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->fd;
+	c->reading = 1;
+	if (have_bufs) {
+		sqe->flags |= IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		// Keeps receiving into the next provided buffer (kernel >= 6.0).
+		if (multishot_recv)
+			sqe->ioprio |= IORING_RECV_MULTISHOT;
+	} else {
+		sqe->addr = (unsigned long)c->rbuf;
+		sqe->len = URING_BUF_SIZE;
+	}
+}
 
-	if (listen(listen_fd, BACKLOG) < 0) {
-		perror("listen");
-		close(listen_fd);
-		listen_fd = -1;
-		return -1;
+/* Over OUT_HIGH: stop the multishot RECV, its completion ends the stream. */
+static void
+uring_pause(Conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	c->paused = 1;
+	if (!c->reading || (sqe = uring_sqe(NULL, UR_CANCEL)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)(uintptr_t)c | UR_RECV;
+}
+
+/* Submit the head of the queue in one SENDMSG, as outqSend() does. */
+static void
+uring_send(Conn *c)
+{
+	struct io_uring_sqe *sqe;
+	SendState *st;
+	int cnt;
+
+	if (c->send == NULL
+		&& (c->send = (SendState *)malloc(sizeof(SendState))) == NULL) {
+		perror("malloc send");
+		conn_close(c);
+		return;
+	}
+	st = c->send;
+	if ((cnt = outqIov(
+			 &c->out, st->iov, OUTQ_IOV, st->bounce, sizeof(st->bounce)))
+			<= 0
+		|| (sqe = uring_sqe(c, UR_SEND)) == NULL) {
+		conn_close(c);
+		return;
+	}
+	memset(&st->msg, 0, sizeof(st->msg));
+	st->msg.msg_iov = st->iov;
+	st->msg.msg_iovlen = cnt;
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = c->fd;
+	sqe->addr = (unsigned long)&st->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	if (!c->sending) {
+		c->write_start = now_ms();
+		c->written = 0;
+	}
+	c->sending = 1;
+}
+
+/* Once the handler has returned: submit what it wrote, then close or
+ * read on.
+ */
+static void
+uring_served(Conn *c)
+{
+	if (c->fd >= 0 && c->broken)
+		conn_close(c);
+	if (c->fd >= 0 && c->out.bytes > 0 && !c->sending)
+		uring_send(c);
+	if (c->fd >= 0 && c->out.bytes > OUT_HIGH && !c->paused)
+		uring_pause(c);
+	if (c->fd >= 0 && (c->close_after || c->rdhup) && !c->sending)
+		conn_close(c);
+	if (c->fd >= 0 && !c->reading && !c->paused && !c->close_after
+		&& !c->rdhup)
+		uring_recv(c);
+}
+
+/* Coroutine body: serve every request received so far. */
+static void
+uring_serve(void *arg)
+{
+	dispatch_all((Conn *)arg, loop_handler);
+}
+
+/* Run the handler on the complete requests, in a coroutine if it may
+ * wait, see requestWait().
+ */
+static void
+uring_dispatch(Conn *c)
+{
+	if (conn_frame(c) > 0 && (c->co = coroCreate(uring_serve, c)) != NULL) {
+		if (!conn_resume(c))
+			return;
+	} else {
+		dispatch_all(c, loop_handler);
+	}
+	uring_served(c);
+}
+
+/* Resume a suspended handler, see conn_wake(). */
+static void
+uring_wake(Conn *c)
+{
+	if (conn_resume(c))
+		uring_served(c);
+	if (c->fd >= 0 && !c->co)
+		conn_arm(c);
+}
+
+static void
+uring_accepted(int slot, int res)
+{
+	struct accept_slot *a = &accepts[slot];
+	Conn *c;
+
+	if (res < 0) {
+		if (res != -EAGAIN && res != -EINTR && res != -ECANCELED)
+			fprintf(stderr, "accept: %s\n", strerror(-res));
+	} else if (!admit_client(res, &a->addr)) {
+		// answered and closed
+	} else if ((c = conn_new(res, &a->addr)) == NULL) {
+		rateDisconnect(a->addr.sin_addr);
+		close(res);
+	} else {
+		c->uring = 1;
+		uring_recv(c);
+		if (c->fd >= 0)
+			conn_arm(c);
+		else if (c->inflight == 0)
+			conn_free(c);
+	}
+	if (!draining)
+		uring_accept(slot);
+}
+
+static void
+uring_received(Conn *c, int res, unsigned int flags)
+{
+	unsigned short bid = (unsigned short)(flags >> IORING_CQE_BUFFER_SHIFT);
+	int more = flags & IORING_CQE_F_MORE;
+	const char *data = c->rbuf;
+
+	if (flags & IORING_CQE_F_BUFFER)
+		data = uringBuf(&rbufs, bid);
+
+	if (c->fd < 0) {
+		// already closed
+	} else if (res == -EINVAL && multishot_recv) {
+		multishot_recv = 0;
+	} else if (res == -ENOBUFS) {
+		// All provided buffers in use: retry once some are recycled
+	} else if (res == -ECANCELED) {
+		// Paused by uring_pause()
+	} else if (res < 0) {
+		// A suspended handler still refers to it: closed once it returns
+		if (c->co)
+			c->broken = 1;
+		else
+			conn_close(c);
+	} else if (res == 0) {
+		// Client closed its side, answer what is complete then close.
+		c->rdhup = 1;
+		if (!c->sending && !c->co)
+			uring_dispatch(c);
+		if (c->fd >= 0 && !c->sending && !c->co)
+			conn_close(c);
+	} else if (c->reject) {
+		// Over the limits: dropped until the answer is sent
+	} else if (conn_reserve(c, (size_t)res) < 0) {
+		conn_close(c);
+	} else {
+		if (c->len == 0 && c->nrequests > 0)
+			c->req_start = now_ms();
+		memcpy(c->buf + c->len, data, (size_t)res);
+		c->len += (size_t)res;
+		c->last_active = now_ms();
+		conn_frame(c);
+		// Requests wait behind a response being sent or a suspended
+		// handler: read no more than one full request ahead
+		if ((c->sending || c->co) && c->len >= HEADER_MAX + BODY_MAX
+			&& !c->paused)
+			uring_pause(c);
+		// A request arriving while the previous response is still being
+		// sent is served from uring_sent(), while a handler waits from
+		// uring_wake().
+		if (!c->sending && !c->co)
+			uring_dispatch(c);
 	}
 
+	if (flags & IORING_CQE_F_BUFFER)
+		uringRecycleBuf(&rbufs, bid);
+	if (!more)
+		c->reading = 0;
+	if (c->fd >= 0 && !c->reading && !c->paused && !c->close_after
+		&& !c->rdhup && !c->broken)
+		uring_recv(c);
+}
+
+/* requestWait() under io_uring: a POLL_ADD resumes the handler. */
+static int
+uring_poll(Conn *c, int fd, short events)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(c, UR_POLL)) == NULL)
+		return -1;
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = (unsigned int)events;
 	return 0;
 }
 
-// Little helper to find the end of HTTP headers: \r\n\r\n
+/* The wait timed out: cancel its POLL_ADD, whose completion is ignored. */
+static void
+uring_unpoll(Conn *c)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((sqe = uring_sqe(NULL, UR_CANCEL)) == NULL)
+		return;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (uint64_t)(uintptr_t)c | UR_POLL;
+}
+
+static void
+uring_polled(Conn *c, int res)
+{
+	if (c->co && c->wait_fd >= 0 && res != -ECANCELED)
+		uring_wake(c);
+}
+
+static void
+uring_sent(Conn *c, int res)
+{
+	if (c->fd < 0)
+		return;
+	if (res < 0) {
+		conn_close(c);
+		return;
+	}
+	c->last_active = now_ms();
+	outqConsume(&c->out, (size_t)res);
+	c->written += (size_t)res;
+	if (c->paused && c->out.bytes <= OUT_LOW) {
+		c->paused = 0;
+		if (!c->reading && !c->close_after && !c->rdhup)
+			uring_recv(c);
+	}
+	if (c->fd >= 0 && c->out.bytes > 0) {
+		uring_send(c);
+		return;
+	}
+	c->sending = 0;
+	free(c->send);
+	c->send = NULL;
+	if (c->fd >= 0 && !c->close_after)
+		uring_dispatch(c);
+	if (c->fd >= 0 && !c->sending && !c->co
+		&& (c->close_after || c->rdhup
+			|| (draining && c->len == 0 && c->nrequests > 0)))
+		conn_close(c);
+}
+
+static void
+uring_complete(struct io_uring_cqe *cqe)
+{
+	Conn *c = (Conn *)(uintptr_t)(cqe->user_data & ~(uint64_t)UR_OP_MASK);
+	int op = (int)(cqe->user_data & UR_OP_MASK);
+
+	switch (op) {
+	case UR_ACCEPT:
+		uring_accepted((int)(cqe->user_data >> UR_SLOT_SHIFT), cqe->res);
+		return;
+	case UR_TICK:
+		timers_run();
+		uring_tick();
+		return;
+	case UR_CANCEL:
+		return;
+	}
+
+	// A multishot entry stays queued as long as F_MORE is set.
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		c->inflight--;
+	if (op == UR_RECV)
+		uring_received(c, cqe->res, cqe->flags);
+	else if (op == UR_POLL)
+		uring_polled(c, cqe->res);
+	else
+		uring_sent(c, cqe->res);
+	// A suspended handler keeps the timer of its wait
+	if (c->co)
+		return;
+	if (c->fd >= 0)
+		conn_arm(c);
+	else if (c->inflight == 0)
+		conn_free(c);
+}
+
+/* Returns -1 right away if the ring cannot be set up, the caller then falls
+ * back to epoll. Otherwise returns 0 once drained, -1 on error.
+ */
 static int
-headers_complete(const char *buf, size_t len)
+uring_loop(void)
 {
-	if (len < 4)
-		return 0;
+	struct io_uring_cqe *cqe, done;
+	int i;
 
-	for (size_t i = 0; i <= len - 4; ++i) {
-		if (buf[i] == '\r'
-			&& buf[i + 1] == '\n'
-			&& buf[i + 2] == '\r'
-			&& buf[i + 3] == '\n') {
-			return 1;
+	if (uringInit(&ring, URING_ENTRIES) < 0) {
+		perror("io_uring_setup");
+		return -1;
+	}
+	have_bufs = uringSetupBufs(&ring,
+							   &rbufs,
+							   URING_BGID,
+							   URING_BUFS,
+							   URING_BUF_SIZE)
+		== 0;
+	printf("Using io_uring%s\n", have_bufs ? " with provided buffers" : "");
+	for (i = 0; i < URING_ACCEPTS; i++)
+		uring_accept(i);
+	uring_tick();
+
+	while (1) {
+		if (uringSubmit(&ring, 1) < 0 && errno != EINTR) {
+			perror("io_uring_enter");
+			return -1;
+		}
+		while ((cqe = uringPeekCqe(&ring)) != NULL) {
+			// Release the slot first, the handler may submit more.
+			done = *cqe;
+			uringCqeSeen(&ring);
+			uring_complete(&done);
 		}
+		if (loop_signals())
+			return 0;
 	}
-	return 0;
 }
+#endif /* WITH_URING */
 
-message *
-getRequest(short int port)
+int
+requestLoop(int fd, request_handler handler)
 {
-	int client_fd;
-	struct sockaddr_in client_addr;
-	socklen_t addrlen = sizeof(client_addr);
+	struct epoll_event events[MAXEVENTS];
+	int i, n, efd;
+	Conn *c;
+
+	signals_init();
+	upgradeReady();
+#ifdef WITH_URING
+	if (uring_enabled) {
+		listen_fd = fd;
+		loop_handler = handler;
+		if (conns_init() < 0)
+			return -1;
+		if ((n = uring_loop()) == 0 || ring.fd >= 0)
+			return n;
+		fprintf(stderr, "io_uring unavailable, using epoll\n");
+	}
+#endif
+	if (loop_init(fd, handler) < 0)
+		return -1;
+	use_coros = 1;
+
+	while (1) {
+		// Wake up every tick to expire connection timers.
+		n = epoll_wait(epoll_fd, events, MAXEVENTS, TIMER_TICK);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == listen_fd) {
+				accept_clients(EPOLLET);
+				continue;
+			}
+			efd = events[i].data.fd;
+			if ((c = conns[efd]) == NULL && (c = waiters[efd]) == NULL)
+				continue;
+			if (c->co) {
+				// Its handler is suspended: only what it waits for wakes
+				// it up.
+				if (c->wait_fd == efd)
+					conn_wake(c);
+				continue;
+			}
 
-	// First call: create listening socket.
-	if (listen_fd < 0) {
-		if (init_server(port) < 0) {
-			return NULL;
+			conn_process(c, events[i].events);
 		}
+		// After the events: a connection whose bytes were waiting behind a
+		// slow one is not expired before they are read.
+		timers_run();
+		if (loop_signals())
+			return 0;
 	}
+}
 
-	// Wait for a client connection.
-	client_fd = accept(listen_fd, (struct sockaddr *)&client_addr, &addrlen);
-	if (client_fd < 0) {
-		perror("accept");
-		return NULL;
+/* Pool thread: serve one ready connection, then hand it back to epoll. */
+static void
+serve_ready(void *item)
+{
+	Conn *c = (Conn *)item;
+	struct epoll_event ev;
+	int fd = c->fd;
+	uint32_t events;
+	int busy;
+
+	while (1) {
+		events = __atomic_exchange_n(&c->events, 0, __ATOMIC_ACQUIRE);
+		if (conn_process(c, events) < 0)
+			return;
+
+		// Re-arm the one-shot registration, the next event may go to any
+		// thread. Level-triggered: a paused client is only watched for
+		// room to send.
+		ev.events = EPOLLONESHOT
+			| (c->paused || c->rdhup ? 0 : EPOLLIN | EPOLLRDHUP)
+			| (c->out.bytes > 0 ? EPOLLOUT : 0);
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			perror("epoll_ctl");
+		// Then give c back, it must not be touched afterwards. Events that
+		// came since the re-arm are served first.
+		busy = 1;
+		if (__atomic_compare_exchange_n(
+				&c->busy, &busy, 0, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			return;
+		__atomic_store_n(&c->busy, 1, __ATOMIC_RELAXED);
 	}
+}
+
+/* CPU of each pool thread, cycling over the allowed CPUs, or NULL. */
+static int *
+pin_threads(int nthreads)
+{
+	int allowed[CPU_MAX], *cpus, n, i;
 
-	// Read one HTTP request from the client.
-	size_t cap = 4096;
-	size_t len = 0;
-	char *buf = (char *)malloc(cap);
-	if (!buf) {
+	if ((n = cpuList(allowed, CPU_MAX)) <= 0)
+		return NULL;
+	if ((cpus = (int *)malloc(nthreads * sizeof(int))) == NULL) {
 		perror("malloc");
-		close(client_fd);
 		return NULL;
 	}
+	for (i = 0; i < nthreads; i++)
+		cpus[i] = allowed[i % n];
+	return cpus;
+}
+
+int
+requestLoopThreads(int fd, int nthreads, request_handler handler)
+{
+	struct epoll_event events[MAXEVENTS];
+	int i, n, *cpus = NULL;
+	Pool *pool;
+	Conn *c;
+
+	signals_init();
+	upgradeReady();
+	if (loop_init(fd, handler) < 0)
+		return -1;
+	if (nthreads <= 0)
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+	threaded = 1;
+	if (cpu_pinning)
+		cpus = pin_threads(nthreads);
+	if ((pool = poolCreate(nthreads, serve_ready, cpus)) == NULL)
+		return -1;
+	printf("Serving with %d threads\n", nthreads);
+	for (i = 0; cpus && i < nthreads; i++)
+		printf("Thread %d on cpu %d (node %d)\n", i, cpus[i], cpuNode(cpus[i]));
 
-	// We only need to support GET/HEAD; reading until \r\n\r\n is enough.
-	while (!headers_complete(buf, len)) {
-		ssize_t n = recv(client_fd, buf + len, cap - len, 0);
+	while (1) {
+		n = epoll_wait(epoll_fd, events, MAXEVENTS, TIMER_TICK);
 		if (n < 0) {
-			// read error
-			perror("recv");
-			free(buf);
-			close(client_fd);
-			return NULL;
-		}
-		if (n == 0) {
-			// client closed connection before sending full request
-			free(buf);
-			close(client_fd);
-			return NULL;
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			return -1;
 		}
 
-		len += (size_t)n;
-
-		// grow buffer if needed
-		if (len + 1 >= cap) {
-			cap *= 2;
-			char *nbuf = (char *)realloc(buf, cap);
-			if (!nbuf) {
-				perror("realloc");
-				free(buf);
-				close(client_fd);
-				return NULL;
+		for (i = 0; i < n; i++) {
+			if (events[i].data.fd == listen_fd) {
+				// Clients report one event at a time: a connection is
+				// only ever served by one thread.
+				accept_clients(EPOLLONESHOT);
+				continue;
 			}
-			buf = nbuf;
+			if ((c = conns[events[i].data.fd]) == NULL)
+				continue;
+
+			if (conn_take(c, events[i].events))
+				poolPush(pool, c);
 		}
+		timers_run();
+		if (loop_signals())
+			return 0;
 	}
+}
 
-	// Null-terminate for convenience
-	buf[len] = '\0';
+int
+requestWait(int fd, short events, int timeout)
+{
+	Conn *c = coro_conn;
+	struct pollfd pfd;
+	struct epoll_event ev;
+	int own;
 
-	message *m = (message *)malloc(sizeof(message));
-	if (!m) {
-		perror("malloc message");
-		free(buf);
-		close(client_fd);
-		return NULL;
+	if (c == NULL) {
+		pfd.fd = fd;
+		pfd.events = events;
+		return poll(&pfd, 1, timeout);
 	}
 
-	m->buf = buf;
-	m->len = (unsigned int)len;
-	// clientId = socket fd
-	m->clientId = (unsigned int)client_fd;
-
-	m->clientAddress = (struct sockaddr_in *)malloc(sizeof(struct sockaddr_in));
-	if (!m->clientAddress) {
-		perror("malloc clientAddress");
-		free(buf);
-		free(m);
-		close(client_fd);
-		return NULL;
+	own = fd == c->fd;
+	if (c->uring) {
+		// The completion of a POLL_ADD resumes it, see uring_polled()
+#ifdef WITH_URING
+		if (uring_poll(c, fd, events) < 0)
+			return -1;
+#endif
+	} else {
+		// The client socket stays registered edge-triggered, MOD reports
+		// it right away if it is already ready.
+		ev.events = (events & POLLIN ? EPOLLIN : 0)
+			| (events & POLLOUT ? EPOLLOUT : 0)
+			| (own ? EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET
+				   : EPOLLONESHOT);
+		ev.data.fd = fd;
+		if (epoll_ctl(
+				epoll_fd, own ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev)
+			< 0)
+			return -1;
+		if (!own)
+			waiters[fd] = c;
 	}
-	*(m->clientAddress) = client_addr;
+	c->wait_fd = fd;
+	c->timedout = 0;
+	if (timeout >= 0) {
+		conn_arm_at(c, now_ms() + timeout);
+	} else {
+		timers_lock();
+		timerCancel(&c->timer);
+		timers_unlock();
+	}
+
+	coroYield();
 
-	return m;
+	c->wait_fd = -1;
+	if (c->uring) {
+#ifdef WITH_URING
+		if (c->timedout)
+			uring_unpoll(c);
+#endif
+	} else if (!own) {
+		waiters[fd] = NULL;
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+	}
+	return c->timedout ? 0 : 1;
 }
 
 void
@@ -188,33 +2118,126 @@ sendReponse(message *r)
 	if (!r)
 		return;
 
-	int fd = (int)r->clientId;
-	size_t off = 0;
-
-	while (off < r->len) {
-		ssize_t n = send(fd, r->buf + off, r->len - off, 0);
-		if (n <= 0)
-			break;
-		off += (size_t)n;
-	}
+	writeDirectClient((int)r->clientId, r->buf, r->len);
 }
 
-// Experimental streaming write: send directly to the socket fd (clientId).
+// Streaming write to the client socket fd (clientId). Bytes are queued on
+// the connection and sent by the loop as the client reads them.
 void
 writeDirectClient(int i, char *buf, unsigned int len)
 {
 	int fd = i; // clientId == socket fd in this implementation.
-	size_t off = 0;
 
-	while (off < len) {
-		ssize_t n = send(fd, buf + off, len - off, 0);
-		if (n <= 0)
-			break;
-		off += (size_t)n;
+	if (fd >= 0 && fd < nconns && conns[fd]) {
+		conn_write(conns[fd], buf, len);
+		return;
+	}
+	send_all(fd, buf, len);
+}
+
+void
+writeFileClient(int i, int file, off_t off, size_t len)
+{
+	Conn *c;
+
+	if (i >= 0 && i < nconns && (c = conns[i]) != NULL) {
+		if (c->broken)
+			close(file);
+		else if (outqFile(&c->out, file, off, len) < 0)
+			c->broken = 1;
+		return;
+	}
+	copy_file(i, file, off, len);
+	close(file);
+}
+
+void
+writeSharedFileClient(int i,
+					  int file,
+					  off_t off,
+					  size_t len,
+					  buffer_release release,
+					  void *arg)
+{
+	Conn *c;
+
+	if (i >= 0 && i < nconns && (c = conns[i]) != NULL) {
+		if (c->broken)
+			release(arg);
+		else if (outqFileRef(&c->out, file, off, len, release, arg) < 0)
+			c->broken = 1;
+		return;
+	}
+	copy_file(i, file, off, len);
+	release(arg);
+}
+
+void
+writeBufferClient(int i,
+				  const char *buf,
+				  size_t len,
+				  buffer_release release,
+				  void *arg)
+{
+	Conn *c;
+
+	if (i >= 0 && i < nconns && (c = conns[i]) != NULL) {
+		if (c->broken) {
+			if (release)
+				release(arg);
+		} else if (outqRef(&c->out, buf, len, release, arg) < 0) {
+			c->broken = 1;
+		}
+		return;
 	}
+	// Not a connection of the loop: blocking copy
+	send_all(i, buf, len);
+	if (release)
+		release(arg);
+}
+
+void
+requestFlush(int i)
+{
+	Conn *c;
+
+	// io_uring: the ring sends it once the handler returns
+	if (i < 0 || i >= nconns || (c = conns[i]) == NULL
+		|| !(use_coros || threaded))
+		return;
+	conn_flush(c);
 }
 
-// Nothing buffered: nothing special to do here.
+void
+writeChunkClient(int i, const char *buf, size_t len)
+{
+	char size[24];
+	int n;
+
+	// chunk = chunk-size CRLF chunk-data CRLF, last-chunk = "0" CRLF CRLF
+	n = snprintf(size, sizeof(size), "%zx\r\n", len);
+	writeDirectClient(i, size, (unsigned int)n);
+	if (len > 0)
+		writeDirectClient(i, (char *)buf, (unsigned int)len);
+	writeDirectClient(i, "\r\n", 2);
+	requestFlush(i);
+}
+
+void
+writeChunkBufferClient(
+	int i, const char *buf, size_t len, buffer_release release, void *arg)
+{
+	char size[24];
+	int n;
+
+	n = snprintf(size, sizeof(size), "%zx\r\n", len);
+	writeDirectClient(i, size, (unsigned int)n);
+	writeBufferClient(i, buf, len, release, arg);
+	writeDirectClient(i, "\r\n", 2);
+	requestFlush(i);
+}
+
+// The loop sends queued bytes: nothing special to do here.
 // We keep it to satisfy the original API.
 void
 endWriteDirectClient(int i)
@@ -223,6 +2246,13 @@ endWriteDirectClient(int i)
 	// no-op
 }
 
+void
+requestShed(int i)
+{
+	writeDirectClient(i, (char *)overloaded, sizeof(overloaded) - 1);
+	requestShutdownSocket(i);
+}
+
 // Ask to close the TCP connection for this client.
 void
 requestShutdownSocket(int i)
@@ -231,6 +2261,11 @@ requestShutdownSocket(int i)
 	if (fd < 0)
 		return;
 
+	// The loop closes it once what is queued has been sent.
+	if (fd < nconns && conns[fd]) {
+		conns[fd]->close_after = 1;
+		return;
+	}
 	shutdown(fd, SHUT_RDWR);
 	close(fd);
 }
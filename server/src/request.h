@@ -2,43 +2,268 @@
 #define _REQUEST_H_
 
 #include <netinet/in.h>
+#include <sys/types.h>
 
-#ifndef MAXCLIENT
-#define MAXCLIENT 10
+#include <stddef.h>
+
+#ifndef MAXEVENTS
+#define MAXEVENTS 64
+#endif
+
+/* Persistent connections: a kept-alive socket is closed after this many
+ * seconds without traffic, or once it has served KEEPALIVE_MAX requests.
+ */
+#ifndef KEEPALIVE_TIMEOUT
+#define KEEPALIVE_TIMEOUT 5
+#endif
+
+#ifndef KEEPALIVE_MAX
+#define KEEPALIVE_MAX 100
+#endif
+
+/* Limits against slow clients, in seconds. A request header must arrive
+ * within HEADER_TIMEOUT of its first byte and a request body within
+ * BODY_TIMEOUT of the end of the header. Both grow by one second per
+ * MIN_RATE bytes received, up to HEADER_TIMEOUT_MAX and BODY_TIMEOUT_MAX.
+ * A response must make progress at least every WRITE_TIMEOUT and, past
+ * WRITE_TIMEOUT, be read at MIN_RATE bytes per second on average.
+ */
+#ifndef HEADER_TIMEOUT
+#define HEADER_TIMEOUT 10
+#endif
+
+#ifndef HEADER_TIMEOUT_MAX
+#define HEADER_TIMEOUT_MAX 30
+#endif
+
+#ifndef BODY_TIMEOUT
+#define BODY_TIMEOUT 10
+#endif
+
+#ifndef BODY_TIMEOUT_MAX
+#define BODY_TIMEOUT_MAX 60
+#endif
+
+#ifndef WRITE_TIMEOUT
+#define WRITE_TIMEOUT 10
+#endif
+
+/* Seconds a closed connection keeps its socket while the kernel may still
+ * read buffers it sent with MSG_ZEROCOPY (-z). Past that the socket is
+ * reset and the buffers released.
+ */
+#ifndef ZEROCOPY_LINGER
+#define ZEROCOPY_LINGER 5
+#endif
+
+/* Largest request read, in bytes. A longer header is answered with 431, a
+ * body announced longer with 413, and the connection is closed. Bytes
+ * pipelined past HEADER_MAX + BODY_MAX buffered are left in the socket
+ * until the requests before them are served.
+ */
+#ifndef HEADER_MAX
+#define HEADER_MAX 8192
+#endif
+
+#ifndef BODY_MAX
+#define BODY_MAX (1 << 20)
+#endif
+
+#ifndef MIN_RATE
+#define MIN_RATE 500 /* bytes per second */
+#endif
+
+/* Admission limits, per process. Past them clients get a prebuilt 503
+ * telling them to come back after RETRY_AFTER seconds. MAX_CONNS 0 allows
+ * as many connections as the fd limit leaves once FD_RESERVE descriptors
+ * are kept for files and FastCGI, and FDCACHE_FILES for the file cache;
+ * MAX_REQUESTS 0 does not limit requests.
+ * See requestSetLimits().
+ */
+#ifndef MAX_CONNS
+#define MAX_CONNS 0
+#endif
+
+#ifndef MAX_REQUESTS
+#define MAX_REQUESTS 0
+#endif
+
+#ifndef FD_RESERVE
+#define FD_RESERVE 64
+#endif
+
+#ifndef RETRY_AFTER
+#define RETRY_AFTER 1
+#endif
+
+/* Seconds a draining loop waits for its connections to finish. */
+#ifndef DRAIN_TIMEOUT
+#define DRAIN_TIMEOUT 30
 #endif
 
 /* One HTTP request read from a client connection.
  * - clientId is the connected socket fd (used directly by write* functions)
  * - buf is NULL-terminated for convenience
  * - len is the number of bytes read (without the terminating NULL)
- * - clientAddress is allocated and filled by getRequest(); freeRequest() frees it
+ * - clientAddress is allocated by the event loop; freeRequest() frees it
+ * - keepAlive is 0 when this is the last request allowed on the connection
  */
 typedef struct message {
 	unsigned int clientId; /* socket fd of the client */
 	char *buf;			   /* request bytes (heap, NULL-terminated) */
 	unsigned int len;	   /* number of valid bytes in buf */
 	struct sockaddr_in *clientAddress; /* peer address (heap) */
+	int keepAlive; /* connection may serve another request */
 } message;
 
-/* Blocking accept + read of a single HTTP request on the given TCP port.
- * Returns a heap-allocated message on success, or NULL on error.
- * The first call lazily creates the listening socket.
+/* Called by requestLoop() for every complete request. The handler owns the
+ * message and must release it with freeRequest(). Unless the handler closes
+ * it with requestShutdownSocket(), the connection stays open and its next
+ * request is read on the same socket.
+ */
+typedef void (*request_handler)(message *request);
+
+/* Create a non-blocking listening socket on the given TCP port.
+ * With reuseport, SO_REUSEPORT lets several processes listen on the same
+ * port, each with its own socket and accept queue. After an upgrade, the
+ * listeners inherited from the previous binary are taken first, in order.
+ * Returns the socket fd, or -1 on error.
+ */
+int requestListen(short int port, int reuseport);
+
+/* Backlog of the sockets created by requestListen() from now on. Values
+ * above net.core.somaxconn are capped to it; 0 (default) uses it as is.
+ */
+void requestSetBacklog(int backlog);
+
+/* Past maxconns open connections, a new client is answered 503 right
+ * after accept. Past maxrequests requests being handled (a handler
+ * waiting in requestWait() counts), a complete request is answered 503
+ * instead of reaching the handler. 0 keeps the defaults above. Call
+ * before the loop starts.
  */
-message *getRequest(short int port);
+void requestSetLimits(int maxconns, int maxrequests);
 
-/* Free a message returned by getRequest(), including buf and clientAddress. */
+/* Send the buffers handlers lend with writeBufferClient() with
+ * MSG_ZEROCOPY from OUTQ_ZEROCOPY bytes on (see outq.h): large cached or
+ * generated bodies are then read by the kernel in place. epoll loops
+ * only, io_uring copies them. Off by default. Call before the loop starts.
+ */
+void requestSetZerocopy(int on);
+
+/* Smallest lent buffer sent with MSG_ZEROCOPY, 0 while it is off: a
+ * handler producing a body may lend copies of its large pieces instead of
+ * writing them.
+ */
+size_t requestZerocopyMin(void);
+
+/* Non-blocking edge-triggered epoll loop on the listening socket fd.
+ * Accepts clients, reads their bytes as they arrive and calls handler once
+ * a full request header has been received. A slow client never stalls the
+ * others while its request is incomplete. Pipelined requests are handled in
+ * order and their responses sent together. Responses wait in an output
+ * queue until the socket has room: a client that does not read them is
+ * not read either (see OUT_HIGH in request.c).
+ * SIGQUIT drains the loop: it stops accepting, closes idle connections,
+ * answers the requests under way with "Connection: close" and returns 0
+ * once every connection is closed or after DRAIN_TIMEOUT. SIGUSR2 first
+ * hands fd over to a new binary (see upgradeSpawn()), then drains.
+ * SIGUSR1 prints the file cache counters of the process.
+ * Otherwise only returns (-1) on error.
+ */
+int requestLoop(int fd, request_handler handler);
+
+/* Threaded variant of requestLoop(): the calling thread accepts clients and
+ * waits for their events, each ready connection is then served by one of
+ * nthreads pool threads (nthreads <= 0: one per online CPU). Idle threads
+ * steal ready connections queued behind a busy one. Signals are handled
+ * as in requestLoop().
+ */
+int requestLoopThreads(int fd, int nthreads, request_handler handler);
+
+/* Wait until fd is ready for events (POLLIN, POLLOUT), at most timeout ms
+ * (-1: no limit). Called from a handler run by requestLoop(), epoll or
+ * io_uring, it suspends the handler and the loop serves the other
+ * connections meanwhile; elsewhere it blocks in poll().
+ * Returns > 0 once ready, 0 on timeout, -1 on error.
+ */
+int requestWait(int fd, short events, int timeout);
+
+/* Free a message, including buf and clientAddress. */
 void freeRequest(message *r);
 
 /* Write the full r->buf to r->clientId */
 void sendReponse(message *r);
 
-/* Stream write bytes directly to the client socket */
+/* Stream write bytes to the client socket. They are copied to the output
+ * queue of the connection and sent as the client reads them: the handler
+ * never waits for a slow client.
+ */
 void writeDirectClient(int i, char *buf, unsigned int len);
 
+/* Queue len bytes of the open file file from offset off after what was
+ * written so far. The connection takes file over and closes it once sent;
+ * the bytes are only read when the socket has room for them.
+ */
+void writeFileClient(int i, int file, off_t off, size_t len);
+
+/* Gives a buffer lent to writeBufferClient() back to its owner. */
+typedef void (*buffer_release)(void *arg);
+
+/* Like writeFileClient(), but file stays the caller's: it is read at the
+ * offsets given only, and release(arg) is called once the range is sent,
+ * or when the connection closes. For descriptors shared by requests.
+ */
+void writeSharedFileClient(int i,
+						   int file,
+						   off_t off,
+						   size_t len,
+						   buffer_release release,
+						   void *arg);
+
+/* Queue len bytes at buf after what was written so far, without copying
+ * them. buf must not change until release(arg) is called (if release is
+ * not NULL): once sent, once the kernel is done with its pages when sent
+ * with MSG_ZEROCOPY (see requestSetZerocopy()), or when the connection
+ * closes. Release may run in another thread than the handler.
+ */
+void writeBufferClient(int i,
+					   const char *buf,
+					   size_t len,
+					   buffer_release release,
+					   void *arg);
+
+/* Send what was written to client i so far, as far as its socket takes
+ * it, without waiting: for a body written while it is produced. The rest
+ * leaves once the handler returns. No-op with io_uring, whose loop sends
+ * only then.
+ */
+void requestFlush(int i);
+
+/* Write len bytes of a body of unknown length as one chunk of
+ * Transfer-Encoding: chunked (HTTP/1.1), then requestFlush(). len 0 writes
+ * the last chunk, which ends the body.
+ */
+void writeChunkClient(int i, const char *buf, size_t len);
+
+/* Like writeChunkClient(), but the chunk data is lent as with
+ * writeBufferClient(). len must not be 0.
+ */
+void writeChunkBufferClient(int i,
+							const char *buf,
+							size_t len,
+							buffer_release release,
+							void *arg);
+
 /* End-of-write hook to mirror historical APIs. No-op in this implementation. */
 void endWriteDirectClient(int i);
 
-/* Shutdown and close the client socket. Safe to call once per connection. */
+/* Answer the prebuilt 503 and close, for handlers shedding load. */
+void requestShed(int i);
+
+/* Close the client socket once what was written to it has been sent. Safe
+ * to call once per connection.
+ */
 void requestShutdownSocket(int i);
 
 #endif /* _REQUEST_H_ */
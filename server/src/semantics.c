@@ -1,6 +1,10 @@
+#define _GNU_SOURCE /* strptime(), timegm() */
+
 #include <ctype.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "api.h"
 #include "conf.h"
@@ -15,6 +19,10 @@ static int http_version(Request *req, _Token *root);
 static int host(Request *req, _Token *root);
 static int content_length(Request *req, _Token *root);
 static int connection(Request *req, _Token *root);
+static int ranges(Request *req, _Token *root);
+static int validators(Request *req, _Token *root);
+static int accept_encoding(Request *req, _Token *root);
+static time_t http_date(const char *value, int len);
 
 void static pct_normalize(char *target);
 void static remove_dot_segments(char *target);
@@ -31,6 +39,12 @@ char *const connections[] = {
 	[KEEP_ALIVE] = "keep-alive",
 	[CLOSE] = "close",
 };
+char *const encodings[] = {
+	[BR] = "br",
+	[ZSTD] = "zstd",
+	[GZIP] = "gzip",
+	[DEFLATE] = "deflate",
+};
 
 Request *
 semantics(_Token *root)
@@ -46,7 +60,10 @@ semantics(_Token *root)
 		|| http_version(req, root)
 		|| host(req, root)
 		|| content_length(req, root)
-		|| connection(req, root))
+		|| connection(req, root)
+		|| ranges(req, root)
+		|| validators(req, root)
+		|| accept_encoding(req, root))
 		return req;
 	return req;
 }
@@ -54,10 +71,20 @@ semantics(_Token *root)
 static void
 initreq(Request *req)
 {
+	req->method = -1;
 	req->host = -1;
 	req->target = NULL;
 	req->status = 200;
-	req->connection = CLOSE;
+	/* Unset: decided by the Connection header or the HTTP version */
+	req->connection = -1;
+	req->nranges = 0;
+	req->if_range_tag.value = NULL;
+	req->if_range_tag.len = 0;
+	req->if_range_date = -1;
+	req->if_none_match.value = NULL;
+	req->if_none_match.len = 0;
+	req->if_modified_since = -1;
+	memset(req->accept, 0, sizeof(req->accept));
 }
 
 static int
@@ -135,7 +162,7 @@ host(Request *req, _Token *root)
 	int i;
 
 	if (((tok = searchTree(root, "host")) == NULL && req->version == HTTP1_1)
-		|| tok->next != NULL) {
+		|| (tok != NULL && tok->next != NULL)) {
 		req->status = 400;
 		return 1;
 	}
@@ -233,6 +260,208 @@ connection(Request *req, _Token *root)
 	return 0;
 }
 
+/* Decimal digits at *p, saturated instead of overflowing. */
+static long long
+range_pos(char **p, char *end)
+{
+	long long v = 0;
+
+	for (; *p < end && isdigit(**p); (*p)++) {
+		if (v > (LLONG_MAX - 9) / 10)
+			v = LLONG_MAX;
+		else
+			v = v * 10 + (**p - '0');
+	}
+	return v;
+}
+
+/* Range and If-Range, only for GET. The grammar already checked the
+ * syntax of the set: the ranges are read from its text, in order. A Range
+ * header that is repeated, holds more than RANGE_MAX ranges or a range
+ * ending before it starts is ignored, as is one next to several If-Range.
+ */
+static int
+ranges(Request *req, _Token *root)
+{
+	_Token *tok;
+	Node set, cond;
+	ByteRange *r;
+	char *p, *end;
+
+	if (req->method != GET
+		|| (tok = searchTree(root, "byte_range_set")) == NULL)
+		return 0;
+	if (tok->next != NULL) {
+		purgeElement(&tok);
+		return 0;
+	}
+	set.value = getElementValue(tok->node, &set.len);
+	purgeElement(&tok);
+	p = set.value;
+	end = set.value + set.len;
+	while (p < end) {
+		if (*p == ',' || *p == ' ' || *p == '\t') {
+			p++;
+			continue;
+		}
+		if (req->nranges == RANGE_MAX) {
+			req->nranges = 0;
+			return 0;
+		}
+		r = &req->ranges[req->nranges++];
+		r->first = *p == '-' ? -1 : range_pos(&p, end);
+		p++; /* '-' */
+		r->last = p < end && isdigit(*p) ? range_pos(&p, end) : -1;
+		if ((r->first == -1 && r->last == -1)
+			|| (r->first >= 0 && r->last >= 0 && r->last < r->first)) {
+			req->nranges = 0;
+			return 0;
+		}
+	}
+
+	if ((tok = searchTree(root, "If_Range")) == NULL)
+		return 0;
+	if (tok->next != NULL) {
+		req->nranges = 0;
+		purgeElement(&tok);
+		return 0;
+	}
+	/* entity-tag = [ W/ ] DQUOTE ..., never a date */
+	cond.value = getElementValue(tok->node, &cond.len);
+	if (cond.value[0] == '"' || (cond.len > 1 && cond.value[1] == '/'))
+		req->if_range_tag = cond;
+	else
+		req->if_range_date = http_date(cond.value, cond.len);
+	purgeElement(&tok);
+	return 0;
+}
+
+/* If-None-Match and If-Modified-Since, kept for the handler to compare
+ * with the file. Repeated, they are ignored: the full response is always
+ * a correct answer.
+ */
+static int
+validators(Request *req, _Token *root)
+{
+	_Token *tok;
+	Node date;
+
+	if ((tok = searchTree(root, "If_None_Match")) != NULL) {
+		if (tok->next == NULL)
+			req->if_none_match.value =
+				getElementValue(tok->node, &req->if_none_match.len);
+		purgeElement(&tok);
+	}
+	if ((tok = searchTree(root, "If_Modified_Since")) != NULL) {
+		if (tok->next == NULL) {
+			date.value = getElementValue(tok->node, &date.len);
+			req->if_modified_since = http_date(date.value, date.len);
+		}
+		purgeElement(&tok);
+	}
+	return 0;
+}
+
+/* Weight of a coding: what follows it in the list, up to the next comma,
+ * as thousandths of 1. The grammar already checked its syntax:
+ * OWS ";" OWS "q=" qvalue.
+ */
+static short
+coding_weight(char **p, char *end)
+{
+	short q;
+
+	while (*p < end && (**p == ' ' || **p == '\t'))
+		(*p)++;
+	if (*p == end || **p != ';')
+		return 1000;
+	while (**p != '=')
+		(*p)++;
+	(*p)++;
+	q = (*(*p)++ - '0') * 1000;
+	if (*p < end && **p == '.')
+		(*p)++;
+	if (*p < end && isdigit(**p))
+		q += (*(*p)++ - '0') * 100;
+	if (*p < end && isdigit(**p))
+		q += (*(*p)++ - '0') * 10;
+	if (*p < end && isdigit(**p))
+		q += *(*p)++ - '0';
+	return q;
+}
+
+/* Accept-Encoding, all of its headers: the weight of each coding the
+ * server sends, that of "*" for those not named.
+ */
+static int
+accept_encoding(Request *req, _Token *root)
+{
+	_Token *tok, *t;
+	Node list;
+	short named[N_ENCODINGS], star = 0, q;
+	char *p, *end, *name;
+	int i, len;
+
+	if ((tok = searchTree(root, "Accept_Encoding")) == NULL)
+		return 0;
+	for (i = 0; i < N_ENCODINGS; i++)
+		named[i] = -1;
+	for (t = tok; t != NULL; t = t->next) {
+		list.value = getElementValue(t->node, &list.len);
+		p = list.value;
+		end = list.value + list.len;
+		while (p < end) {
+			if (*p == ',' || *p == ' ' || *p == '\t') {
+				p++;
+				continue;
+			}
+			name = p;
+			while (p < end && *p != ',' && *p != ';' && *p != ' '
+				   && *p != '\t')
+				p++;
+			len = p - name;
+			q = coding_weight(&p, end);
+			if (len == 1 && name[0] == '*')
+				star = q;
+			for (i = 0; i < N_ENCODINGS; i++)
+				if ((int)strlen(encodings[i]) == len
+					&& strncasecmp(name, encodings[i], len) == 0)
+					named[i] = q;
+		}
+	}
+	purgeElement(&tok);
+	for (i = 0; i < N_ENCODINGS; i++)
+		req->accept[i] = named[i] == -1 ? star : named[i];
+	return 0;
+}
+
+/* Seconds since the epoch of an HTTP-date in any of its three formats,
+ * -1 if it is not one.
+ */
+static time_t
+http_date(const char *value, int len)
+{
+	static const char *const formats[] = {
+		"%a, %d %b %Y %H:%M:%S GMT", /* IMF-fixdate */
+		"%A, %d-%b-%y %H:%M:%S GMT", /* rfc850-date */
+		"%a %b %e %H:%M:%S %Y",		 /* asctime-date */
+	};
+	char buf[64], *end;
+	struct tm tm;
+	int i;
+
+	if (len <= 0 || len >= (int)sizeof(buf))
+		return -1;
+	memcpy(buf, value, len);
+	buf[len] = '\0';
+	for (i = 0; i < (int)(sizeof(formats) / sizeof(formats[0])); i++) {
+		memset(&tm, 0, sizeof(tm));
+		if ((end = strptime(buf, formats[i], &tm)) != NULL && *end == '\0')
+			return timegm(&tm);
+	}
+	return -1;
+}
+
 static void
 pct_normalize(char *target)
 {
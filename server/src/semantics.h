@@ -2,7 +2,9 @@
 #define _SEMANTICS_H_
 
 #include <string.h>
+#include <time.h>
 
+#include "api.h"
 #include "httpparser.h"
 
 enum methods {
@@ -20,17 +22,43 @@ enum connections {
 	CLOSE,
 	N_CONNECTIONS
 };
+/* Content codings the server sends, by order of preference among those
+ * the client weighs alike.
+ */
+enum encodings {
+	BR,
+	ZSTD,
+	GZIP,
+	DEFLATE,
+	N_ENCODINGS
+};
 extern char *const methods[];
 extern char *const versions[];
 extern char *const connections[];
+extern char *const encodings[];
 
 #define CHUNKED "chunked"
 
+/* A Range header with more ranges than this is ignored: the whole
+ * representation is sent instead.
+ */
+#ifndef RANGE_MAX
+#define RANGE_MAX 16
+#endif
+
 typedef struct node {
 	char *value;
 	int len;
 } Node;
 
+/* bytes=first-last as requested. first -1: the last `last` bytes (suffix
+ * range); last -1: up to the end.
+ */
+typedef struct byte_range {
+	long long first;
+	long long last;
+} ByteRange;
+
 typedef struct request {
 	int method;
 	int version;
@@ -38,6 +66,14 @@ typedef struct request {
 	char *target;
 	int connection;
 	int status;
+	int nranges; /* GET with a Range header honoured, 0 otherwise */
+	ByteRange ranges[RANGE_MAX];
+	Node if_range_tag;		  /* If-Range entity-tag, value NULL if none */
+	time_t if_range_date;	  /* If-Range HTTP-date, -1 if none */
+	Node if_none_match;		  /* "*" or entity-tags, value NULL if none */
+	time_t if_modified_since; /* -1 if none */
+	/* Accept-Encoding weight of each coding in thousandths, 0: refused */
+	short accept[N_ENCODINGS];
 } Request;
 
 Request *semantics(_Token *root);
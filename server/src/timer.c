@@ -0,0 +1,136 @@
+#include <stddef.h>
+
+#include "timer.h"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_SPAN(level) (1ULL << (TIMER_BITS * (level)))
+
+static void
+list_append(Timer *head, Timer *t)
+{
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+/* Move every timer of list src to the end of list dst. */
+static void
+list_splice(Timer *dst, Timer *src)
+{
+	if (src->next == src)
+		return;
+	src->next->prev = dst->prev;
+	dst->prev->next = src->next;
+	src->prev->next = dst;
+	dst->prev = src->prev;
+	timerInit(src);
+}
+
+void
+timerInit(Timer *t)
+{
+	t->next = t;
+	t->prev = t;
+}
+
+int
+timerPending(Timer *t)
+{
+	return t->next != t;
+}
+
+void
+timerWheelInit(TimerWheel *w, unsigned long long now)
+{
+	int l, s;
+
+	w->now = now;
+	for (l = 0; l < TIMER_LEVELS; l++)
+		for (s = 0; s < TIMER_SLOTS; s++)
+			timerInit(&w->slots[l][s]);
+}
+
+/* Link t in the slot matching its expiry, relative to the wheel time. */
+static void
+wheel_insert(TimerWheel *w, Timer *t)
+{
+	unsigned long long delta;
+	int level = 0;
+
+	if (t->expires <= w->now)
+		t->expires = w->now + 1;
+	delta = t->expires - w->now;
+	// Beyond the wheel: park in the farthest slot, it cascades again.
+	if (delta >= TIMER_SPAN(TIMER_LEVELS))
+		t->expires = w->now + TIMER_SPAN(TIMER_LEVELS) - 1;
+	while (level < TIMER_LEVELS - 1 && delta >= TIMER_SPAN(level + 1))
+		level++;
+	list_append(&w->slots[level][(t->expires >> (TIMER_BITS * level))
+								 & TIMER_MASK],
+				t);
+}
+
+void
+timerAdd(TimerWheel *w, Timer *t, unsigned long long expires)
+{
+	timerCancel(t);
+	t->expires = expires;
+	wheel_insert(w, t);
+}
+
+void
+timerCancel(Timer *t)
+{
+	if (!timerPending(t))
+		return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	timerInit(t);
+}
+
+/* Spread the timers of the current slot of level one level down. */
+static void
+cascade(TimerWheel *w, int level, Timer *expired)
+{
+	Timer list, *t;
+	int slot = (int)((w->now >> (TIMER_BITS * level)) & TIMER_MASK);
+
+	timerInit(&list);
+	list_splice(&list, &w->slots[level][slot]);
+	while ((t = timerPop(&list)) != NULL) {
+		if (t->expires <= w->now)
+			list_append(expired, t);
+		else
+			wheel_insert(w, t);
+	}
+}
+
+void
+timerAdvance(TimerWheel *w, unsigned long long now, Timer *expired)
+{
+	int level;
+
+	timerInit(expired);
+	while (w->now < now) {
+		w->now++;
+		// Crossing into a new slot of the level above: refill lower ones.
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if (w->now & (TIMER_SPAN(level) - 1))
+				break;
+			cascade(w, level, expired);
+		}
+		list_splice(expired, &w->slots[0][w->now & TIMER_MASK]);
+	}
+}
+
+Timer *
+timerPop(Timer *list)
+{
+	Timer *t = list->next;
+
+	if (t == list)
+		return NULL;
+	timerCancel(t);
+	return t;
+}
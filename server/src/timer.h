@@ -0,0 +1,46 @@
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/* Hierarchical timer wheel.
+ * Time is counted in ticks. Level 0 has one slot per tick, each level
+ * above covers TIMER_SLOTS slots of the level below; timers are moved down
+ * one level when the wheel reaches their slot. Adding and cancelling a
+ * timer are O(1) whatever the number of timers.
+ */
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+/* Embedded in the object it times out. Also used as a list head. */
+typedef struct timer {
+	struct timer *next;
+	struct timer *prev;
+	unsigned long long expires; /* tick */
+} Timer;
+
+typedef struct timer_wheel {
+	unsigned long long now; /* last tick processed */
+	Timer slots[TIMER_LEVELS][TIMER_SLOTS];
+} TimerWheel;
+
+void timerWheelInit(TimerWheel *w, unsigned long long now);
+
+/* Mark a timer as not pending, or empty a list head. */
+void timerInit(Timer *t);
+int timerPending(Timer *t);
+
+/* (Re)arm t to expire at tick expires. Past ticks expire at the next
+ * timerAdvance().
+ */
+void timerAdd(TimerWheel *w, Timer *t, unsigned long long expires);
+void timerCancel(Timer *t);
+
+/* Process ticks up to now, moving the timers that expired to the list
+ * expired. Timers still in it can be cancelled or re-armed.
+ */
+void timerAdvance(TimerWheel *w, unsigned long long now, Timer *expired);
+
+/* Unlink and return the first timer of a list, or NULL. */
+Timer *timerPop(Timer *list);
+
+#endif
@@ -0,0 +1,160 @@
+#define _GNU_SOURCE /* execvpe(), pipe2() */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "upgrade.h"
+#include "util.h"
+
+/* Most listeners handed over, one per worker. */
+#define UPGRADE_MAX 1024
+
+extern char **environ;
+
+static char **cmdline = NULL;
+static int inherited[UPGRADE_MAX];
+static int ninherited = 0;
+static int next_inherited = 0;
+static int ready_fd = -1;
+
+void
+upgradeInit(int argc, char *argv[])
+{
+	char *s, *end;
+	long fd;
+	int i;
+
+	cmdline = emalloc((argc + 1) * sizeof(char *));
+	for (i = 0; i < argc; i++)
+		cmdline[i] = argv[i];
+	cmdline[argc] = NULL;
+
+	if ((s = getenv(UPGRADE_LISTEN_ENV)) != NULL) {
+		while (*s && ninherited < UPGRADE_MAX) {
+			fd = strtol(s, &end, 10);
+			if (end == s)
+				break;
+			// Not for the processes we may start later
+			if (fd >= 0 && fcntl((int)fd, F_SETFD, FD_CLOEXEC) == 0)
+				inherited[ninherited++] = (int)fd;
+			s = *end == ',' ? end + 1 : end;
+		}
+	}
+	if ((s = getenv(UPGRADE_READY_ENV)) != NULL) {
+		ready_fd = atoi(s);
+		if (fcntl(ready_fd, F_SETFD, FD_CLOEXEC) < 0)
+			ready_fd = -1;
+	}
+	unsetenv(UPGRADE_LISTEN_ENV);
+	unsetenv(UPGRADE_READY_ENV);
+}
+
+int
+upgradeListener(void)
+{
+	if (next_inherited >= ninherited)
+		return -1;
+	return inherited[next_inherited++];
+}
+
+void
+upgradeReady(void)
+{
+	if (ready_fd < 0)
+		return;
+	if (write(ready_fd, "1", 1) != 1)
+		perror("upgrade: write");
+	close(ready_fd);
+	ready_fd = -1;
+
+	// Started with fewer workers than the previous binary: the listeners
+	// left would queue connections nobody accepts.
+	while (next_inherited < ninherited)
+		close(inherited[next_inherited++]);
+	printf("Took over the listeners of the previous binary\n");
+}
+
+pid_t
+upgradeSpawn(const int *fds, int n)
+{
+	char *listen_var, ready_var[64];
+	char **envp;
+	int pipefd[2], nenv, len, i, r;
+	struct pollfd pfd;
+	sigset_t none;
+	pid_t pid;
+	char c;
+
+	if (cmdline == NULL || n <= 0 || n > UPGRADE_MAX)
+		return -1;
+	if (pipe2(pipefd, O_CLOEXEC) < 0) {
+		perror("pipe2");
+		return -1;
+	}
+
+	// Everything the child needs is built here: once forked from a
+	// threaded process, it may only make async-signal-safe calls.
+	listen_var = emalloc(sizeof(UPGRADE_LISTEN_ENV) + 12 * n);
+	len = sprintf(listen_var, "%s=", UPGRADE_LISTEN_ENV);
+	for (i = 0; i < n; i++)
+		len += sprintf(listen_var + len, i ? ",%d" : "%d", fds[i]);
+	snprintf(ready_var,
+			 sizeof(ready_var),
+			 "%s=%d",
+			 UPGRADE_READY_ENV,
+			 pipefd[1]);
+	for (nenv = 0; environ[nenv]; nenv++)
+		;
+	envp = emalloc((nenv + 3) * sizeof(char *));
+	memcpy(envp, environ, nenv * sizeof(char *));
+	envp[nenv] = listen_var;
+	envp[nenv + 1] = ready_var;
+	envp[nenv + 2] = NULL;
+	sigemptyset(&none);
+
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(listen_var);
+		free(envp);
+		return -1;
+	}
+	if (pid == 0) {
+		for (i = 0; i < n; i++)
+			fcntl(fds[i], F_SETFD, 0);
+		fcntl(pipefd[1], F_SETFD, 0);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		execvpe(cmdline[0], cmdline, envp);
+		_exit(127);
+	}
+	close(pipefd[1]);
+	free(listen_var);
+	free(envp);
+
+	// EOF without a byte: the exec or the startup of the new binary failed
+	pfd.fd = pipefd[0];
+	pfd.events = POLLIN;
+	while ((r = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000)) < 0 && errno == EINTR)
+		;
+	if (r > 0 && read(pipefd[0], &c, 1) == 1) {
+		close(pipefd[0]);
+		printf("Upgraded to %s, pid %d\n", cmdline[0], (int)pid);
+		return pid;
+	}
+	close(pipefd[0]);
+	fprintf(stderr, "upgrade: %s did not start, keep serving\n", cmdline[0]);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+#include <sys/types.h>
+
+/* Binary upgrade without closing the listening sockets.
+ * The running server starts the binary it was launched from again, with
+ * the same arguments, and hands it its listeners as inherited descriptors
+ * listed in UPGRADE_LISTEN_ENV. Once the new server has taken them over it
+ * writes a byte to the pipe named by UPGRADE_READY_ENV; the old one then
+ * stops accepting and drains its connections. Connections queued in the
+ * meantime wait in the shared accept queue: none are refused.
+ */
+#define UPGRADE_LISTEN_ENV "HTTP_SERVER_LISTEN_FDS"
+#define UPGRADE_READY_ENV "HTTP_SERVER_READY_FD"
+
+/* Seconds given to the new binary to report it is ready. */
+#ifndef UPGRADE_TIMEOUT
+#define UPGRADE_TIMEOUT 10
+#endif
+
+/* Keep the command line to start again, before getopt() reorders it. */
+void upgradeInit(int argc, char *argv[]);
+
+/* Next listener inherited from the previous binary, in the order it listed
+ * them, or -1 when there is none left.
+ */
+int upgradeListener(void);
+
+/* Tell the previous binary that we serve its listeners, and close the
+ * inherited ones left unused. Does nothing when not started by an upgrade.
+ */
+void upgradeReady(void);
+
+/* Start the new binary with listeners fds[0..n-1] and wait until it is
+ * ready. Returns its pid, or -1 if it could not start in time (it is then
+ * killed and the caller keeps serving).
+ */
+pid_t upgradeSpawn(const int *fds, int n);
+
+#endif
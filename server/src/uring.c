@@ -0,0 +1,237 @@
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+int uring_enabled = 0;
+
+#ifdef WITH_URING
+
+int
+uringInit(Uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	void *sq, *cq;
+
+	memset(r, 0, sizeof(Uring));
+	memset(&p, 0, sizeof(p));
+	if ((r->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0)
+		return -1;
+	r->features = p.features;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size =
+		p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	// Kernels with SINGLE_MMAP share one mapping for both rings
+	if (r->features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+
+	sq = mmap(NULL,
+			  r->sq_ring_size,
+			  PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE,
+			  r->fd,
+			  IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		goto fail;
+	r->sq_ring = sq;
+	if (r->features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL,
+				  r->cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE,
+				  r->fd,
+				  IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			goto fail;
+	}
+	r->cq_ring = cq;
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL,
+				   r->sqes_size,
+				   PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE,
+				   r->fd,
+				   IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = (unsigned int *)((char *)sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int *)((char *)sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)((char *)cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int *)((char *)cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+	return 0;
+
+fail:
+	uringExit(r);
+	return -1;
+}
+
+void
+uringExit(Uring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->fd >= 0)
+		close(r->fd);
+	memset(r, 0, sizeof(Uring));
+	r->fd = -1;
+}
+
+struct io_uring_sqe *
+uringGetSqe(Uring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail, idx;
+
+	head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+	tail = *r->sq_tail + r->sq_pending;
+	if (tail - head >= r->sq_entries) {
+		// Queue full: hand what we have to the kernel first
+		if (uringSubmit(r, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+		tail = *r->sq_tail + r->sq_pending;
+		if (tail - head >= r->sq_entries)
+			return NULL;
+	}
+	idx = tail & *r->sq_mask;
+	sqe = &r->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_array[idx] = idx;
+	r->sq_pending++;
+	return sqe;
+}
+
+int
+uringSubmit(Uring *r, unsigned int wait_nr)
+{
+	unsigned int n = r->sq_pending;
+	int ret;
+
+	__atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+	r->sq_pending = 0;
+	do {
+		ret = (int)syscall(__NR_io_uring_enter,
+						   r->fd,
+						   n,
+						   wait_nr,
+						   wait_nr ? IORING_ENTER_GETEVENTS : 0,
+						   NULL,
+						   0);
+	} while (ret < 0 && errno == EINTR && wait_nr == 0);
+	return ret;
+}
+
+struct io_uring_cqe *
+uringPeekCqe(Uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+		return NULL;
+	return &r->cqes[head & *r->cq_mask];
+}
+
+void
+uringCqeSeen(Uring *r)
+{
+	__atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+int
+uringSetupBufs(Uring *r, UringBufs *b, unsigned short bgid,
+			   unsigned int nbufs, unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	size_t ring_size = nbufs * sizeof(struct io_uring_buf);
+	unsigned int i;
+
+	memset(b, 0, sizeof(UringBufs));
+	b->br = mmap(NULL,
+				 ring_size,
+				 PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS,
+				 -1,
+				 0);
+	if (b->br == MAP_FAILED) {
+		b->br = NULL;
+		return -1;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (unsigned long)b->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = bgid;
+	if (syscall(__NR_io_uring_register,
+				r->fd,
+				IORING_REGISTER_PBUF_RING,
+				&reg,
+				1)
+		< 0) {
+		munmap(b->br, ring_size);
+		b->br = NULL;
+		return -1;
+	}
+
+	if ((b->base = malloc((size_t)nbufs * size)) == NULL) {
+		perror("malloc uring buffers");
+		return -1;
+	}
+	b->nbufs = nbufs;
+	b->size = size;
+	b->bgid = bgid;
+	for (i = 0; i < nbufs; i++) {
+		struct io_uring_buf *buf = &b->br->bufs[i];
+		buf->addr = (unsigned long)(b->base + (size_t)i * size);
+		buf->len = size;
+		buf->bid = (unsigned short)i;
+	}
+	__atomic_store_n(&b->br->tail, (unsigned short)nbufs, __ATOMIC_RELEASE);
+	return 0;
+}
+
+char *
+uringBuf(UringBufs *b, unsigned short bid)
+{
+	return b->base + (size_t)bid * b->size;
+}
+
+void
+uringRecycleBuf(UringBufs *b, unsigned short bid)
+{
+	unsigned short tail = b->br->tail;
+	struct io_uring_buf *buf = &b->br->bufs[tail & (b->nbufs - 1)];
+
+	buf->addr = (unsigned long)uringBuf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	tail++;
+	__atomic_store_n(&b->br->tail, tail, __ATOMIC_RELEASE);
+}
+
+#endif /* WITH_URING */
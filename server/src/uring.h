@@ -0,0 +1,73 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#ifdef WITH_URING
+#include <linux/io_uring.h>
+
+/* Minimal io_uring ring driven through the raw system calls. */
+typedef struct uring {
+	int fd;
+	unsigned int features;
+	/* submission queue */
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_entries;
+	unsigned int sq_pending; /* sqes filled since the last submit */
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* mappings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} Uring;
+
+/* Provided buffer ring: the kernel picks a buffer of the group when data
+ * arrives, so idle connections do not pin a receive buffer each.
+ */
+typedef struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	char *base;
+	unsigned int nbufs; /* power of 2 */
+	unsigned int size;
+	unsigned short bgid;
+} UringBufs;
+
+/* Returns 0, or -1 with errno set (ENOSYS/EPERM on kernels without it). */
+int uringInit(Uring *r, unsigned int entries);
+void uringExit(Uring *r);
+
+/* Next free submission entry, zeroed. Submits pending ones if the queue is
+ * full. Returns NULL if no entry could be freed.
+ */
+struct io_uring_sqe *uringGetSqe(Uring *r);
+
+/* Submit pending entries and wait for at least wait_nr completions.
+ * Returns the number of submitted entries, or -1 with errno set.
+ */
+int uringSubmit(Uring *r, unsigned int wait_nr);
+
+/* Oldest unseen completion, or NULL. */
+struct io_uring_cqe *uringPeekCqe(Uring *r);
+void uringCqeSeen(Uring *r);
+
+/* Register nbufs buffers of size bytes as group bgid (kernel >= 5.19).
+ * Returns 0, or -1 if the kernel does not support buffer rings.
+ */
+int uringSetupBufs(Uring *r, UringBufs *b, unsigned short bgid,
+				   unsigned int nbufs, unsigned int size);
+char *uringBuf(UringBufs *b, unsigned short bid);
+void uringRecycleBuf(UringBufs *b, unsigned short bid);
+#endif
+
+/* Set by main() (-u): the process loops run on io_uring when possible. */
+extern int uring_enabled;
+
+#endif
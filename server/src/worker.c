@@ -0,0 +1,266 @@
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cpu.h"
+#include "request.h"
+#include "upgrade.h"
+#include "util.h"
+#include "worker.h"
+
+typedef struct worker {
+	pid_t pid;
+	int listen_fd;
+	int cpu; /* -1: not pinned */
+	time_t started;
+} Worker;
+
+static Worker *workers = NULL;
+static int nworkers = 0;
+static sigset_t master_signals;
+static int draining = 0; /* workers exiting are not restarted */
+
+static pid_t
+spawn(Worker *w, request_handler handler)
+{
+	sigset_t set;
+	pid_t pid;
+	int i;
+
+	// Do not let the child inherit pending output
+	fflush(stdout);
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (pid == 0) {
+		// Upgrades are the master's business: SIGUSR2 stays blocked
+		set = master_signals;
+		sigdelset(&set, SIGUSR2);
+		sigprocmask(SIG_UNBLOCK, &set, NULL);
+		// Do not outlive the master
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		for (i = 0; i < nworkers; i++) {
+			if (&workers[i] != w)
+				close(workers[i].listen_fd);
+		}
+		// Before requestLoop() allocates anything: its memory is local
+		if (w->cpu >= 0)
+			cpuPin(w->cpu);
+		if (requestLoop(w->listen_fd, handler) < 0)
+			exit(EXIT_FAILURE);
+		exit(EXIT_SUCCESS);
+	}
+	w->pid = pid;
+	w->started = time(NULL);
+	return pid;
+}
+
+static Worker *
+find_worker(pid_t pid)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].pid == pid)
+			return &workers[i];
+	}
+	return NULL;
+}
+
+static void
+reap_workers(request_handler handler)
+{
+	pid_t pid;
+	int status;
+	Worker *w;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		// Not a worker: a new binary that failed to start
+		if ((w = find_worker(pid)) == NULL)
+			continue;
+		w->pid = -1;
+		if (draining)
+			continue;
+		if (WIFSIGNALED(status))
+			fprintf(stderr,
+					"worker %d killed by signal %d\n",
+					(int)pid,
+					WTERMSIG(status));
+		else
+			fprintf(stderr,
+					"worker %d exited with status %d\n",
+					(int)pid,
+					WEXITSTATUS(status));
+		// Crash loop: do not fork as fast as the worker dies
+		if (time(NULL) - w->started < 1)
+			sleep(1);
+		if (spawn(w, handler) > 0)
+			printf("Restarted worker %d as %d\n", (int)pid, (int)w->pid);
+	}
+}
+
+/* Give worker i the i-th allowed CPU (cycling when there are more workers
+ * than CPUs) and steer each CPU's connections to its worker's listener.
+ */
+static void
+pin_workers(void)
+{
+	int *cpus, *fds, ncpus, i;
+
+	cpus = emalloc(CPU_MAX * sizeof(int));
+	if ((ncpus = cpuList(cpus, CPU_MAX)) <= 0) {
+		free(cpus);
+		return;
+	}
+	for (i = 0; i < nworkers; i++)
+		workers[i].cpu = cpus[i % ncpus];
+
+	// A CPU leads to a single listener: only steer the first round
+	if (ncpus > nworkers)
+		ncpus = nworkers;
+	fds = emalloc(ncpus * sizeof(int));
+	for (i = 0; i < ncpus; i++)
+		fds[i] = workers[i].listen_fd;
+	if (cpuSteer(fds, cpus, ncpus) < 0)
+		fprintf(stderr, "Could not steer connections to worker CPUs\n");
+	free(fds);
+	free(cpus);
+}
+
+static int
+workers_alive(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < nworkers; i++)
+		n += workers[i].pid > 0;
+	return n;
+}
+
+static void
+signal_workers(int sig)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].pid > 0)
+			kill(workers[i].pid, sig);
+	}
+}
+
+/* Let every worker finish its connections, see requestLoop(). */
+static void
+drain_workers(void)
+{
+	draining = 1;
+	printf("Master %d draining workers\n", (int)getpid());
+	signal_workers(SIGQUIT);
+}
+
+/* Hand the listeners over to a new binary, then drain. */
+static void
+upgrade(void)
+{
+	int *fds, i;
+
+	fds = emalloc(nworkers * sizeof(int));
+	for (i = 0; i < nworkers; i++)
+		fds[i] = workers[i].listen_fd;
+	if (upgradeSpawn(fds, nworkers) > 0)
+		drain_workers();
+	free(fds);
+}
+
+int
+runWorkers(int n, short int port, request_handler handler)
+{
+	int i, sig;
+
+	if (n <= 0)
+		n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (n <= 0)
+		n = 1;
+
+	workers = emalloc(n * sizeof(Worker));
+	for (i = 0; i < n; i++) {
+		workers[i].pid = -1;
+		workers[i].cpu = -1;
+		if ((workers[i].listen_fd = requestListen(port, 1)) < 0)
+			return -1;
+		nworkers++;
+	}
+	if (cpu_pinning)
+		pin_workers();
+
+	// Signals are handled synchronously by the master loop below
+	sigemptyset(&master_signals);
+	sigaddset(&master_signals, SIGCHLD);
+	sigaddset(&master_signals, SIGTERM);
+	sigaddset(&master_signals, SIGINT);
+	sigaddset(&master_signals, SIGQUIT);
+	sigaddset(&master_signals, SIGUSR1);
+	sigaddset(&master_signals, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &master_signals, NULL);
+
+	// The listeners are ours now, the previous master can drain
+	upgradeReady();
+
+	for (i = 0; i < nworkers; i++) {
+		if (spawn(&workers[i], handler) < 0)
+			return -1;
+	}
+	printf("Master %d started %d workers on port %d\n",
+		   (int)getpid(),
+		   nworkers,
+		   port);
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].cpu >= 0)
+			printf("Worker %d on cpu %d (node %d)\n",
+				   (int)workers[i].pid,
+				   workers[i].cpu,
+				   cpuNode(workers[i].cpu));
+	}
+
+	while (1) {
+		if ((sig = sigwaitinfo(&master_signals, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("sigwaitinfo");
+			return -1;
+		}
+		if (sig == SIGUSR2 && !draining)
+			upgrade();
+		else if (sig == SIGQUIT && !draining)
+			drain_workers();
+		else if (sig == SIGUSR1)
+			signal_workers(SIGUSR1);
+		else if (sig == SIGCHLD)
+			reap_workers(handler);
+		else if (sig == SIGTERM || sig == SIGINT)
+			break;
+		if (draining && workers_alive() == 0)
+			return 0;
+	}
+
+	printf("Master %d stopping workers\n", (int)getpid());
+	for (i = 0; i < nworkers; i++) {
+		if (workers[i].pid > 0)
+			kill(workers[i].pid, SIGTERM);
+	}
+	// Only wait for the workers: a new binary started by an upgrade is
+	// also our child.
+	for (i = 0; i < nworkers; i++) {
+		while (workers[i].pid > 0 && waitpid(workers[i].pid, NULL, 0) < 0
+			   && errno == EINTR)
+			;
+	}
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef _WORKER_H_
+#define _WORKER_H_
+
+#include "request.h"
+
+/* Master process: create one SO_REUSEPORT listener per worker on the given
+ * port, fork n workers (n <= 0: one per online CPU) each running
+ * requestLoop() on its own listener, and restart any worker that dies.
+ * The listeners are owned by the master, so a restarted worker picks up the
+ * connections queued on the socket of the one it replaces.
+ * SIGQUIT drains the workers (see requestLoop()) and SIGUSR2 hands the
+ * listeners over to a new binary first (see upgradeSpawn()). SIGUSR1 is
+ * passed on to the workers.
+ * Returns 0 once SIGTERM/SIGINT stopped the workers or once they have
+ * drained, -1 on error.
+ */
+int runWorkers(int n, short int port, request_handler handler);
+
+#endif